@@ -6,4 +6,16 @@ LIBS="x11 xft freetype2"
 FLAGS="compile_flags.txt"
 
 pkg-config --cflags $LIBS | tr -s ' ' '\n' > $FLAGS
-cc -O3 `cat $FLAGS` -o bin/menu src/*.c `pkg-config --libs $LIBS`
+
+for src in src/stretch.c src/fzy.c src/menu.c src/parallel.c src/str.c src/utf8.c; do
+    cc -O3 -fPIC -fvisibility=hidden -c -o bin/`basename $src .c`.o $src
+done
+
+# Only the menu_* API is left global in the archive, so the helpers cannot clash with the program's
+ld -r -o bin/libmenu.o bin/stretch.o bin/fzy.o bin/menu.o bin/parallel.o bin/str.o bin/utf8.o
+objcopy --localize-hidden bin/libmenu.o
+rm -f bin/libmenu.a
+ar rcs bin/libmenu.a bin/libmenu.o
+cc -shared -o bin/libmenu.so bin/stretch.o bin/fzy.o bin/menu.o bin/parallel.o bin/str.o bin/utf8.o -lpthread
+
+cc -O3 `cat $FLAGS` -o bin/menu src/app.c src/main.c src/prompt.c src/str.c src/utf8.c bin/libmenu.a `pkg-config --libs $LIBS` -lpthread
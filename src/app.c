@@ -1,10 +1,21 @@
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include "app.h"
 #include "config.h"
+#include "da.h"
+#include "str.h"
+#include "utf8.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 #define render_color(c)                                                                            \
     ((XRenderColor) {                                                                              \
@@ -14,29 +25,106 @@
         .alpha = (((c) >> (3 * 8)) & 0xFF) << 8,                                                   \
     })
 
+// Read the items from PATH, or stdin without one
+static int app_load(App *a, const char *path) {
+    a->menu = menu_new();
+    if (a->nth_first) {
+        menu_fields(a->menu, a->delimiter, a->nth_first, a->nth_last);
+    }
+    menu_unique(a->menu, a->unique);
+    if (a->plan) {
+        menu_debug(a->menu, stderr);
+    }
+
+    if (a->index) {
+        if (!menu_open(a->menu, a->index)) {
+            fprintf(stderr, "Error: could not open index '%s'\n", a->index);
+            return 0;
+        }
+        return 1;
+    }
+
+    FILE *f = stdin;
+    if (path) {
+        f = fopen(path, "r");
+        if (!f) {
+            fprintf(stderr, "Error: could not open '%s'\n", path);
+            return 0;
+        }
+    }
+
+    const int ok = menu_load(a->menu, f);
+    const int failed = ferror(f);
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    if (!ok) {
+        if (failed) {
+            fprintf(stderr, "Error: could not read items\n");
+        } else {
+            fprintf(stderr, "Error: more than %u items\n", UINT32_MAX);
+        }
+        return 0;
+    }
+
+    if (a->unique) {
+        fprintf(stderr, "Dropped %zu duplicate items\n", menu_duplicates(a->menu));
+    }
+
+    return 1;
+}
+
+int app_build(App *a) {
+    if (!app_load(a, strcmp(a->build_index, "-") ? a->build_index : NULL)) {
+        return 0;
+    }
+
+    if (!menu_save(a->menu, a->output)) {
+        fprintf(stderr, "Error: could not write index '%s'\n", a->output);
+        return 0;
+    }
+
+    return 1;
+}
+
 int app_init(App *a) {
     // Read Items
     {
-        while (!feof(stdin)) {
-            da_append_many(&a->buffer, NULL, 1024);
-            a->buffer.count += fread(a->buffer.data + a->buffer.count, sizeof(char), 1024, stdin);
+        if (!app_load(a, a->watch)) {
+            return 0;
         }
 
-        Str contents = str_new(a->buffer.data, a->buffer.count);
-        while (contents.size) {
-            Str line = str_split(&contents, '\n');
-            if (line.size) {
-                da_append(&a->items, line);
-            }
+        if (menu_items(a->menu) == 0 && !a->watch) {
+            return 0;
+        }
+    }
+
+    // Watch Items
+    if (a->watch) {
+        // Editors replace files instead of writing to them, so the directory is watched instead
+        char dir[PATH_MAX] = ".";
+        const char *slash = strrchr(a->watch, '/');
+        if (slash) {
+            snprintf(dir, sizeof(dir), "%.*s", (int) max(slash - a->watch, 1), a->watch);
+            a->watch_name = slash + 1;
+        } else {
+            a->watch_name = a->watch;
         }
 
-        if (a->items.count == 0) {
+        a->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (a->watch_fd < 0 ||
+            inotify_add_watch(a->watch_fd, dir, IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO) < 0) {
+            fprintf(stderr, "Error: could not watch '%s'\n", a->watch);
             return 0;
         }
     }
 
     // Initialize X11
     {
+        setlocale(LC_CTYPE, "");
+        XSetLocaleModifiers("");
+
         a->display = XOpenDisplay(NULL);
         if (!a->display) {
             fprintf(stderr, "Error: could not open display\n");
@@ -51,9 +139,17 @@ int app_init(App *a) {
             return 0;
         }
 
+        // Load and upload the printable characters in one batch rather than while measuring them
+        // one at a time. Neither waits for the server, so this saves requests but no round trips
+        FT_UInt glyphs[127 - 32];
+        for (char ch = 32; ch < 127; ch++) {
+            glyphs[ch - 32] = XftCharIndex(a->display, a->font, ch);
+        }
+        XftFontLoadGlyphs(a->display, a->font, FcTrue, glyphs, 127 - 32);
+
         for (char ch = 32; ch < 127; ch++) {
             XGlyphInfo extents = {0};
-            XftTextExtentsUtf8(a->display, a->font, (const FcChar8 *) &ch, 1, &extents);
+            XftGlyphExtents(a->display, a->font, &glyphs[ch - 32], 1, &extents);
             a->font_widths[ch - 32] = extents.xOff;
         }
 
@@ -63,14 +159,13 @@ int app_init(App *a) {
 
     // Create Window
     {
+        // The size of the root window comes with the connection, without asking the server
         const Window root = DefaultRootWindow(a->display);
+        const int    screen = DefaultScreen(a->display);
+        const int    root_width = DisplayWidth(a->display, screen);
+        const int    root_height = DisplayHeight(a->display, screen);
 
-        XWindowAttributes ra = {0};
-        if (!XGetWindowAttributes(a->display, root, &ra)) {
-            fprintf(stderr, "Error: could not get root window attributes\n");
-            return 0;
-        }
-        a->window_width = ra.width * 0.6;
+        a->window_width = root_width * 0.6;
         a->window_height = a->item_height * (ITEMS + 1) + BORDER * 2;
 
         XSetWindowAttributes wa = {0};
@@ -79,8 +174,8 @@ int app_init(App *a) {
         wa.event_mask = ExposureMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask |
                         KeyPressMask | VisibilityChangeMask | FocusChangeMask;
 
-        int x = (ra.width - a->window_width) / 2;
-        int y = (ra.height - a->window_height) / 2;
+        int x = (root_width - a->window_width) / 2;
+        int y = (root_height - a->window_height) / 2;
 
         a->window = XCreateWindow(
             a->display,
@@ -96,6 +191,8 @@ int app_init(App *a) {
             CWOverrideRedirect | CWBackPixel | CWEventMask,
             &wa);
 
+        // Besides opening the display and the font, the grab and the focus query are the only
+        // requests which wait for a reply before the first frame
         XGrabKeyboard(a->display, root, True, GrabModeAsync, GrabModeAsync, CurrentTime);
         XMapRaised(a->display, a->window);
 
@@ -126,21 +223,18 @@ int app_init(App *a) {
         }
     }
 
-    // Initialize Fzy
-    {
-        fzy_init();
-        fzy_filter(
-            &a->fzy, str_new(a->prompt.data, a->prompt.count), a->items.data, a->items.count);
-    }
-
     return 1;
 }
 
 void app_free(App *a) {
-    da_free(&a->items);
-    da_free(&a->buffer);
+    menu_free(a->menu);
     da_free(&a->prompt);
-    fzy_free(&a->fzy);
+    da_free(&a->highlights);
+    da_free(&a->highlight_chars);
+
+    if (a->watch && a->watch_fd >= 0) {
+        close(a->watch_fd);
+    }
 
     if (a->draw) {
         XftDrawDestroy(a->draw);
@@ -150,6 +244,14 @@ void app_free(App *a) {
         XftFontClose(a->display, a->font);
     }
 
+    if (a->ic) {
+        XDestroyIC(a->ic);
+    }
+
+    if (a->im) {
+        XCloseIM(a->im);
+    }
+
     if (a->display) {
         XSetInputFocus(a->display, a->revert_window, a->revert_return, CurrentTime);
         XftColorFree(a->display, a->visual, a->colormap, &a->colors[0]);
@@ -159,21 +261,50 @@ void app_free(App *a) {
     }
 }
 
+// Measure the character starting at AT, returning its length in bytes
+static size_t app_glyph(App *a, Str str, size_t at, int *width) {
+    const char ch = str.data[at];
+    if (32 <= ch && ch < 127) {
+        *width = a->font_widths[ch - 32];
+        return 1;
+    }
+
+    uint32_t rune = 0;
+    const size_t length = utf8_decode(str, at, &rune);
+
+    XGlyphInfo extents = {0};
+    XftTextExtentsUtf8(a->display, a->font, (const FcChar8 *) str.data + at, length, &extents);
+    *width = extents.xOff;
+    return length;
+}
+
+static int app_text_width(App *a, Str str) {
+    int result = 0;
+    for (size_t i = 0; i < str.size;) {
+        int width = 0;
+        i += app_glyph(a, str, i, &width);
+        result += width;
+    }
+    return result;
+}
+
+static int app_baseline(App *a, int y) {
+    return y + a->font->ascent + (a->item_height - a->font_height) / 2;
+}
+
 void app_line(App *a, int x, int y, Str str, XftColor *color) {
-    y += a->font->ascent + (a->item_height - a->font_height) / 2;
-    XftDrawString8(a->draw, color, a->font, x, y, (const FcChar8 *) str.data, str.size);
+    XftDrawStringUtf8(
+        a->draw, color, a->font, x, app_baseline(a, y), (const FcChar8 *) str.data, str.size);
 }
 
 void app_draw(App *a) {
     XClearWindow(a->display, a->window);
 
     int y = BORDER;
-    int prompt_width = 0;
-    for (size_t i = 0; i < a->prompt.count; i++) {
-        prompt_width += a->font_widths[a->prompt.data[i] - 32];
-    }
+    const int prompt_width = app_text_width(a, str_new(a->prompt.data, a->prompt.count));
 
-    const int no_matches_found = a->items.count && !a->fzy.matches.count;
+    const size_t count = menu_count(a->menu);
+    const int no_matches_found = menu_items(a->menu) && !count;
     if (no_matches_found) {
         XSetForeground(a->display, a->gc, NOMATCH_COLOR);
         XFillRectangle(
@@ -182,10 +313,7 @@ void app_draw(App *a) {
     app_line(
         a, BORDER * 2, y, str_new(a->prompt.data, a->prompt.count), &a->colors[!no_matches_found]);
 
-    int cursor_width = 0;
-    for (size_t i = 0; i < a->prompt.cursor; i++) {
-        cursor_width += a->font_widths[a->prompt.data[i] - 32];
-    }
+    const int cursor_width = app_text_width(a, str_new(a->prompt.data, a->prompt.cursor));
 
     if (no_matches_found && a->prompt.cursor < a->prompt.count) {
         XSetForeground(a->display, a->gc, BACKGROUND_COLOR);
@@ -202,7 +330,7 @@ void app_draw(App *a) {
         1,
         a->font_height);
 
-    if (a->fzy.matches.count) {
+    if (count) {
         XSetForeground(a->display, a->gc, HIGHLIGHT_COLOR);
         XFillRectangle(
             a->display,
@@ -214,25 +342,52 @@ void app_draw(App *a) {
             a->item_height);
 
         y += a->item_height;
-        for (size_t i = 0; i < min(a->fzy.matches.count - a->anchor, ITEMS); ++i) {
-            const Match match = a->fzy.matches.data[a->anchor + i];
-            app_line(a, BORDER * 2, y, match.str, &a->colors[1]);
+        a->highlights.count = 0;
+        a->highlight_chars.count = 0;
+        for (size_t i = 0; i < min(count - a->anchor, ITEMS); ++i) {
+            MenuResult result = {0};
+            menu_result(a->menu, a->anchor + i, &result);
+
+            const Str str = str_new(result.data, result.size);
+            app_line(a, BORDER * 2, y, str, &a->colors[1]);
+
+            for (size_t j = 0, p = 0, x = BORDER * 2; j < result.positions_count; j++) {
+                size_t k = result.positions[j];
+                if (k < p) {
+                    p = 0;
+                    x = BORDER * 2;
+                }
 
-            for (size_t j = 0, p = 0, x = BORDER * 2; j < a->prompt.count; j++) {
-                size_t k = match.positions[j];
                 while (p < k) {
-                    x += a->font_widths[match.str.data[p++] - 32];
+                    int w = 0;
+                    p += app_glyph(a, str, p, &w);
+                    x += w;
                 }
 
-                int w = a->font_widths[match.str.data[k] - 32];
-                XSetForeground(a->display, a->gc, MATCH_COLOR);
-                XFillRectangle(a->display, a->window, a->gc, x, y, w, a->item_height);
+                int w = 0;
+                app_glyph(a, str, k, &w);
+
+                XRectangle highlight = {x, y, w, a->item_height};
+                da_append(&a->highlights, highlight);
+
+                uint32_t rune = 0;
+                utf8_decode(str, k, &rune);
 
-                app_line(a, x, y, str_new(match.str.data + k, 1), &a->colors[0]);
+                XftCharSpec spec = {rune, x, app_baseline(a, y)};
+                da_append(&a->highlight_chars, spec);
             }
 
             y += a->item_height;
         }
+
+        if (a->highlights.count) {
+            XSetForeground(a->display, a->gc, MATCH_COLOR);
+            XFillRectangles(
+                a->display, a->window, a->gc, a->highlights.data, a->highlights.count);
+
+            XftDrawCharSpec(
+                a->draw, &a->colors[0], a->font, a->highlight_chars.data, a->highlight_chars.count);
+        }
     }
 
     XSetForeground(a->display, a->gc, BORDER_COLOR);
@@ -249,14 +404,49 @@ void app_draw(App *a) {
 void app_sync(App *a) {
     a->anchor = 0;
     a->current = 0;
-    fzy_filter(&a->fzy, str_new(a->prompt.data, a->prompt.count), a->items.data, a->items.count);
+    menu_query(a->menu, a->prompt.data, a->prompt.count);
     app_draw(a);
 }
 
+void app_print(App *a, size_t index) {
+    MenuResult result = {0};
+    if (menu_result(a->menu, index, &result)) {
+        printf("%.*s\n", (int) result.size, result.data);
+    }
+}
+
+// Insert the text typed by the key into the prompt, through the input method if there is one
+int app_input(App *a, XKeyEvent *event) {
+    char text[32];
+    int length = 0;
+
+    if (a->ic) {
+        Status status = 0;
+        length = Xutf8LookupString(a->ic, event, text, sizeof(text), NULL, &status);
+        if (status != XLookupChars && status != XLookupBoth) {
+            length = 0;
+        }
+    } else {
+        KeySym key = XLookupKeysym(event, event->state & ShiftMask);
+        if (32 <= key && key < 127) {
+            text[length++] = key;
+        }
+    }
+
+    if (length <= 0 || (unsigned char) text[0] < 32 || text[0] == 127) {
+        return 0;
+    }
+
+    for (int i = 0; i < length; i++) {
+        prompt_insert(&a->prompt, text[i]);
+    }
+    return 1;
+}
+
 void app_next(App *a) {
-    if (a->fzy.matches.count) {
+    if (menu_count(a->menu)) {
         a->current += 1;
-        if (a->current == a->fzy.matches.count) {
+        if (a->current == menu_count(a->menu)) {
             a->current = 0;
         }
 
@@ -272,9 +462,9 @@ void app_next(App *a) {
 }
 
 void app_prev(App *a) {
-    if (a->fzy.matches.count) {
+    if (menu_count(a->menu)) {
         if (a->current == 0) {
-            a->current = a->fzy.matches.count - 1;
+            a->current = menu_count(a->menu) - 1;
         } else {
             a->current -= 1;
         }
@@ -290,12 +480,124 @@ void app_prev(App *a) {
     }
 }
 
+// Keep the selection on the same item if it survived the reload
+void app_follow(App *a, size_t item) {
+    const size_t count = menu_count(a->menu);
+    const size_t rank = menu_rank(a->menu, item);
+    if (rank != SIZE_MAX) {
+        a->current = rank;
+    }
+
+    if (a->current >= count) {
+        a->current = count ? count - 1 : 0;
+    }
+
+    if (a->current >= a->anchor + ITEMS) {
+        a->anchor = a->current - ITEMS + 1;
+    }
+
+    if (a->current < a->anchor) {
+        a->anchor = a->current;
+    }
+}
+
+void app_reload(App *a) {
+    FILE *f = fopen(a->watch, "r");
+    if (!f) {
+        return;
+    }
+
+    const size_t item = menu_count(a->menu) ? menu_item(a->menu, a->current) : SIZE_MAX;
+    const int    ok = menu_reload(a->menu, f);
+    fclose(f);
+    if (!ok) {
+        return;
+    }
+
+    app_follow(a, item == SIZE_MAX ? SIZE_MAX : menu_moved(a->menu, item));
+    app_draw(a);
+}
+
+void app_watch(App *a) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    int changed = 0;
+    ssize_t size = 0;
+    while ((size = read(a->watch_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + size;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            if (event->len && !strcmp(event->name, a->watch_name)) {
+                changed = 1;
+            }
+            p += sizeof(*event) + event->len;
+        }
+    }
+
+    if (changed) {
+        app_reload(a);
+    }
+}
+
+// Wait for the next X event, reloading the watched file whenever it changes in the meantime
+int app_wait(App *a) {
+    while (a->watch && !XPending(a->display)) {
+        struct pollfd fds[] = {
+            {.fd = ConnectionNumber(a->display), .events = POLLIN},
+            {.fd = a->watch_fd, .events = POLLIN},
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            app_watch(a);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+// Connecting to the input method takes several round trips, so it waits until the first frame is
+// drawn. Keys typed before then are looked up without it
+static void app_open_im(App *a) {
+    a->im = XOpenIM(a->display, NULL, NULL, NULL);
+    if (a->im) {
+        a->ic = XCreateIC(
+            a->im,
+            XNInputStyle,
+            XIMPreeditNothing | XIMStatusNothing,
+            XNClientWindow,
+            a->window,
+            XNFocusWindow,
+            a->window,
+            NULL);
+    }
+}
+
 void app_loop(App *a) {
+    bool   drawn = false;
     XEvent event = {0};
-    while (!XNextEvent(a->display, &event)) {
+    while (app_wait(a) && !XNextEvent(a->display, &event)) {
+        if (XFilterEvent(&event, None)) {
+            continue;
+        }
+
         switch (event.type) {
         case Expose:
             app_draw(a);
+            if (!drawn) {
+                drawn = true;
+                XFlush(a->display);
+                app_open_im(a);
+            }
             break;
 
         case FocusOut:
@@ -330,23 +632,25 @@ void app_loop(App *a) {
             if (event.xbutton.button == Button1) {
                 const size_t index = event.xbutton.y / a->item_height;
                 if (index) {
-                    if (a->anchor + index < a->fzy.matches.count + 1) {
-                        Str current = a->fzy.matches.data[a->anchor + index - 1].str;
-                        printf("%.*s\n", (int) current.size, current.data);
+                    if (a->anchor + index < menu_count(a->menu) + 1) {
+                        app_print(a, a->anchor + index - 1);
                         return;
                     }
                 } else if (event.xbutton.x >= BORDER * 2) {
                     const size_t pos = event.xbutton.x - BORDER * 2;
 
+                    const Str prompt = str_new(a->prompt.data, a->prompt.count);
                     a->prompt.cursor = a->prompt.count;
-                    for (size_t i = 0, acc = 0; i < a->prompt.cursor; i++) {
-                        const size_t width = a->font_widths[a->prompt.data[i] - 32];
+                    for (size_t i = 0, acc = 0; i < a->prompt.cursor;) {
+                        int width = 0;
+                        const size_t length = app_glyph(a, prompt, i, &width);
                         if (acc + width / 2 >= pos) {
                             a->prompt.cursor = i;
                             break;
                         }
 
                         acc += width;
+                        i += length;
                     }
 
                     app_draw(a);
@@ -356,7 +660,7 @@ void app_loop(App *a) {
 
         case MotionNotify: {
             const size_t index = event.xmotion.y / a->item_height;
-            if (index && a->anchor + index < a->fzy.matches.count + 1) {
+            if (index && a->anchor + index < menu_count(a->menu) + 1) {
                 a->current = a->anchor + index - 1;
                 app_draw(a);
             }
@@ -432,10 +736,7 @@ void app_loop(App *a) {
                     return;
 
                 case XK_Return:
-                    if (a->fzy.matches.count) {
-                        Str current = a->fzy.matches.data[a->current].str;
-                        printf("%.*s\n", (int) current.size, current.data);
-                    }
+                    app_print(a, a->current);
                     return;
 
                 case XK_BackSpace:
@@ -480,9 +781,7 @@ void app_loop(App *a) {
                     break;
 
                 default:
-                    key = XLookupKeysym(&event.xkey, event.xkey.state & ShiftMask);
-                    if (32 <= key && key < 127) {
-                        prompt_insert(&a->prompt, key);
+                    if (app_input(a, &event.xkey)) {
                         app_sync(a);
                     }
                     break;
@@ -3,20 +3,36 @@
 
 #include <X11/Xft/Xft.h>
 #include <X11/Xlib.h>
+#include <stdbool.h>
 
-#include "fzy.h"
+#include "da.h"
+#include "menu.h"
 #include "prompt.h"
 
 typedef struct {
     size_t anchor;
     size_t current;
-    DynamicArray(Str) items;
-    DynamicArray(char) buffer;
 
-    Fzy    fzy;
+    char   delimiter;
+    size_t nth_first;
+    size_t nth_last;
+    bool   unique;
+    bool   plan;
+
+    Menu  *menu;
     Prompt prompt;
 
+    const char *index;
+    const char *build_index;
+    const char *output;
+
+    const char *watch;
+    const char *watch_name;
+    int         watch_fd;
+
     GC       gc;
+    XIM      im;
+    XIC      ic;
     Window   window;
     Visual  *visual;
     Display *display;
@@ -29,6 +45,10 @@ typedef struct {
     int font_height;
     int font_widths[127 - 32];
 
+    // Highlighted characters, drawn together once the rows are
+    DynamicArray(XRectangle) highlights;
+    DynamicArray(XftCharSpec) highlight_chars;
+
     int item_height;
     int window_width;
     int window_height;
@@ -37,6 +57,7 @@ typedef struct {
     Window revert_window;
 } App;
 
+int  app_build(App *a);
 int  app_init(App *a);
 void app_free(App *a);
 void app_loop(App *a);
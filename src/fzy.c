@@ -3,8 +3,14 @@
 #include <ctype.h>
 #include <math.h>
 
+#ifdef __SSE2__
+#    include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "fzy.h"
+#include "parallel.h"
+#include "utf8.h"
 
 #define copy(data, a, b, v)                                                                        \
     do {                                                                                           \
@@ -26,6 +32,13 @@
 #define SCORE_MATCH_CAPITAL     0.7
 #define SCORE_MATCH_CONSECUTIVE 1.0
 
+// Items are only scanned and scored in parallel in chunks of at least this many
+#define SCAN_CHUNK_MIN  (1 << 14)
+#define SCORE_CHUNK_MIN (1 << 12)
+
+// Fewer matches are sorted by comparison, as the radix sort has to go through its histograms
+#define MATCH_RADIX_MIN 256
+
 static double bonus_states[3][256] = {
     {0},
     {
@@ -46,57 +59,98 @@ static double bonus_states[3][256] = {
 
 static size_t bonus_index[256];
 
-static int match_compare(const void *a, const void *b) {
-    double sa = ((Match *) a)->score;
-    double sb = ((Match *) b)->score;
-    return (sa < sb) - (sa > sb);
+static char fold[256];
+
+#define bonus(c, d) bonus_states[bonus_index[(unsigned char) (c)]][(unsigned char) (d)]
+
+static uint32_t match_key(double score) {
+    // Both zeros rank the same
+    const float value = score ? score : 0;
+
+    uint32_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits & 0x80000000 ? ~bits : bits | 0x80000000;
 }
 
-static void match_calculate(Match *m, Fzy *f, Str pattern) {
-    if (pattern.size == 0 || pattern.size > m->str.size) {
-        m->score = SCORE_MIN;
-        return;
-    }
+// Matches rank by ascending order, from the best score to the worst and then by input order
+static uint64_t match_order(Match match) {
+    return (uint64_t) (uint32_t) ~match.key << 32 | match.index;
+}
 
-    if (pattern.size == m->str.size) {
-        for (size_t i = 0; i < pattern.size; i++) {
-            m->positions[i] = i;
-        }
+static int match_compare(const void *a, const void *b) {
+    const uint64_t oa = match_order(*(const Match *) a);
+    const uint64_t ob = match_order(*(const Match *) b);
+    return (oa > ob) - (oa < ob);
+}
 
-        m->score = SCORE_MAX;
-        return;
+static double rune_bonus(uint32_t c, uint32_t d) {
+    const size_t index = c < 0x80 ? bonus_index[c] : (utf8_fold(c) != c ? 2 : 1);
+    if (d < 0x80) {
+        return bonus_states[index][d];
     }
 
+    return index == 2 && utf8_fold(d) == d ? SCORE_MATCH_CAPITAL : 0;
+}
+
+// Decode STR into folded codepoints along with their offsets and bonuses
+static void fzy_decode(Fzy *f, Str str) {
+    f->runes.count = 0;
+    f->offsets.count = 0;
     f->B.count = 0;
-    da_append_many(&f->B, NULL, m->str.size);
 
-    f->D.count = 0;
-    da_append_many(&f->D, NULL, pattern.size * m->str.size);
+    uint32_t d = '/';
+    for (size_t i = 0; i < str.size;) {
+        uint32_t c = 0;
+        const size_t length = utf8_decode(str, i, &c);
 
-    f->M.count = 0;
-    da_append_many(&f->M, NULL, pattern.size * m->str.size);
+        da_append(&f->runes, utf8_fold(c));
+        da_append(&f->offsets, i);
+        da_append(&f->B, rune_bonus(c, d));
 
-    char d = '/';
-    for (size_t i = 0; i < m->str.size; i++) {
-        char c = m->str.data[i];
-        f->B.data[i] = bonus_states[bonus_index[c]][d];
         d = c;
+        i += length;
+    }
+}
+
+static double match_calculate(Fzy *f, const Term *t, Str str, size_t *positions) {
+    fzy_decode(f, str);
+
+    const uint32_t *pattern = t->runes.data;
+    const size_t n = t->runes.count;
+    const size_t m = f->runes.count;
+
+    if (n == 0 || n > m) {
+        return SCORE_MIN;
+    }
+
+    if (n == m) {
+        for (size_t i = 0; i < n; i++) {
+            positions[i] = f->offsets.data[i];
+        }
+
+        return SCORE_MAX;
     }
 
+    f->D.count = 0;
+    da_append_many(&f->D, NULL, n * m);
+
+    f->M.count = 0;
+    da_append_many(&f->M, NULL, n * m);
+
     double *dp = NULL;
     double *mp = NULL;
     double *dc = NULL;
     double *mc = NULL;
 
-    for (size_t i = 0; i < pattern.size; i++) {
-        dc = &f->D.data[i * m->str.size + 0];
-        mc = &f->M.data[i * m->str.size + 0];
+    for (size_t i = 0; i < n; i++) {
+        dc = &f->D.data[i * m + 0];
+        mc = &f->M.data[i * m + 0];
 
         double sp = SCORE_MIN;
-        double sg = i == pattern.size - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
+        double sg = i == n - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
 
-        for (size_t j = 0; j < m->str.size; j++) {
-            if (tolower(pattern.data[i]) == tolower(m->str.data[j])) {
+        for (size_t j = 0; j < m; j++) {
+            if (pattern[i] == f->runes.data[j]) {
                 double score = SCORE_MIN;
                 if (i == 0) {
                     score = (j * SCORE_GAP_LEADING) + f->B.data[j];
@@ -119,16 +173,15 @@ static void match_calculate(Match *m, Fzy *f, Str pattern) {
     }
 
     int match_required = 0;
-    for (long i = pattern.size - 1, j = m->str.size - 1; i >= 0; i--) {
+    for (long i = n - 1, j = m - 1; i >= 0; i--) {
         while (j >= 0) {
-            if (f->D.data[i * m->str.size + j] != SCORE_MIN &&
-                (match_required ||
-                 f->D.data[i * m->str.size + j] == f->M.data[i * m->str.size + j])) {
+            if (f->D.data[i * m + j] != SCORE_MIN &&
+                (match_required || f->D.data[i * m + j] == f->M.data[i * m + j])) {
                 match_required =
                     i && j &&
-                    f->M.data[i * m->str.size + j] ==
-                        f->D.data[(i - 1) * m->str.size + j - 1] + SCORE_MATCH_CONSECUTIVE;
-                m->positions[i] = j--;
+                    f->M.data[i * m + j] ==
+                        f->D.data[(i - 1) * m + j - 1] + SCORE_MATCH_CONSECUTIVE;
+                positions[i] = f->offsets.data[j--];
                 break;
             }
 
@@ -136,33 +189,165 @@ static void match_calculate(Match *m, Fzy *f, Str pattern) {
         }
     }
 
-    m->score = f->M.data[(pattern.size - 1) * m->str.size + m->str.size - 1];
+    return f->M.data[(n - 1) * m + m - 1];
+}
+
+static double kernel_generic(Fzy *f, const Term *t, Str str) {
+    f->positions.count = 0;
+    da_append_many(&f->positions, NULL, t->runes.count);
+    return match_calculate(f, t, str, f->positions.data);
 }
 
-static int fzy_has(Str pattern, Str item) {
-    if (pattern.size > item.size) {
-        return 0;
+// The same recurrence as match_calculate for ASCII terms and items, walking the string in the outer
+// loop so only the current column of D and M is kept, which for a fixed pattern length fits in
+// registers. Iterating the pattern backwards leaves the previous column in place for the row below
+#define KERNEL(N)                                                                                  \
+    static double kernel_##N(Fzy *f, const Term *t, Str str) {                                     \
+        (void) f;                                                                                  \
+        const char *pattern = t->pattern.data;                                                     \
+        if (N >= str.size) {                                                                       \
+            return N == str.size ? SCORE_MAX : SCORE_MIN;                                          \
+        }                                                                                          \
+                                                                                                   \
+        double D[N];                                                                               \
+        double M[N];                                                                               \
+        copy(D, 0, N, SCORE_MIN);                                                                  \
+        copy(M, 0, N, SCORE_MIN);                                                                  \
+                                                                                                   \
+        char d = '/';                                                                              \
+        for (size_t j = 0; j < str.size; j++) {                                                    \
+            const char c = str.data[j];                                                            \
+            const char l = fold[(unsigned char) c];                                                \
+            const double b = bonus(c, d);                                                          \
+            d = c;                                                                                 \
+                                                                                                   \
+            _Pragma("GCC unroll 16") for (size_t i = N; i-- > 0;) {                                \
+                double score = SCORE_MIN;                                                          \
+                if (pattern[i] == l) {                                                             \
+                    if (i == 0) {                                                                  \
+                        score = (j * SCORE_GAP_LEADING) + b;                                       \
+                    } else if (j) {                                                                \
+                        score = max(M[i - 1] + b, D[i - 1] + SCORE_MATCH_CONSECUTIVE);             \
+                    }                                                                              \
+                }                                                                                  \
+                                                                                                   \
+                const double sg = i == N - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;               \
+                D[i] = score;                                                                      \
+                M[i] = max(score, M[i] + sg);                                                      \
+            }                                                                                      \
+        }                                                                                          \
+                                                                                                   \
+        return M[N - 1];                                                                           \
     }
 
-    for (size_t i = 0, j = 0; i < pattern.size; i++) {
-        char lower = tolower(pattern.data[i]);
-        char upper = toupper(pattern.data[i]);
+KERNEL(1)
+KERNEL(2)
+KERNEL(3)
+KERNEL(4)
+KERNEL(5)
+KERNEL(6)
+KERNEL(7)
+KERNEL(8)
+KERNEL(9)
+KERNEL(10)
+KERNEL(11)
+KERNEL(12)
+KERNEL(13)
+KERNEL(14)
+KERNEL(15)
+KERNEL(16)
+
+static const Kernel kernels[] = {
+    kernel_generic,
+    kernel_1,
+    kernel_2,
+    kernel_3,
+    kernel_4,
+    kernel_5,
+    kernel_6,
+    kernel_7,
+    kernel_8,
+    kernel_9,
+    kernel_10,
+    kernel_11,
+    kernel_12,
+    kernel_13,
+    kernel_14,
+    kernel_15,
+    kernel_16,
+};
 
-        int found = 0;
-        while (j < item.size) {
-            char ch = item.data[j++];
-            if (ch == lower || ch == upper) {
-                found = 1;
-                break;
-            }
+static Kernel kernel_select(const Term *t) {
+    if (!t->ascii || t->pattern.count >= sizeof(kernels) / sizeof(*kernels)) {
+        return kernel_generic;
+    }
+
+    return kernels[t->pattern.count];
+}
+
+static size_t find_either(Str str, size_t from, char a, char b) {
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    for (; from + 16 <= str.size; from += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) (str.data + from));
+        const int mask =
+            _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask) {
+            return from + __builtin_ctz(mask);
         }
+    }
+#endif
+
+    for (; from < str.size; from++) {
+        if (str.data[from] == a || str.data[from] == b) {
+            return from;
+        }
+    }
+
+    return str.size;
+}
+
+// Searching for every character only pays off once there are enough bytes to skip over
+static int fzy_has_direct(const Term *t, Str item) {
+    size_t i = 0;
+    for (size_t j = 0; i < t->pattern.count && j < item.size; j++) {
+        i += fold[(unsigned char) item.data[j]] == t->pattern.data[i];
+    }
+
+    return i == t->pattern.count;
+}
 
-        if (!found) {
+static int fzy_has(const Term *t, Str item, int ascii, int direct) {
+    if (ascii) {
+        if (!t->ascii || t->pattern.count > item.size) {
             return 0;
         }
+
+        if (direct) {
+            return fzy_has_direct(t, item);
+        }
+
+        for (size_t i = 0, j = 0; i < t->pattern.count; i++, j++) {
+            j = find_either(item, j, t->pattern.data[i], toupper(t->pattern.data[i]));
+            if (j == item.size) {
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    size_t i = 0;
+    for (size_t j = 0; i < t->runes.count && j < item.size;) {
+        uint32_t c = 0;
+        j += utf8_decode(item, j, &c);
+        if (utf8_fold(c) == t->runes.data[i]) {
+            i++;
+        }
     }
 
-    return 1;
+    return i == t->runes.count;
 }
 
 void fzy_init(void) {
@@ -170,34 +355,512 @@ void fzy_init(void) {
     copy(bonus_index, 'A', 'Z', 2);
     copy(bonus_index, 'a', 'z', 1);
     copy(bonus_index, '0', '9', 1);
+
+    for (size_t i = 0; i < 256; i++) {
+        fold[i] = tolower(i);
+    }
+}
+
+static void fzy_truncate(Fzy *f, size_t count) {
+    while (f->terms.count > count) {
+        Term *t = &f->terms.data[--f->terms.count];
+        da_free(&t->pattern);
+        da_free(&t->runes);
+        da_free(&t->candidates);
+    }
 }
 
 void fzy_free(Fzy *f) {
     da_free(&f->B);
     da_free(&f->D);
     da_free(&f->M);
-    da_free(&f->matches);
+    da_free(&f->runes);
+    da_free(&f->offsets);
+
+    for (size_t i = 0; i < f->scratch.count; i++) {
+        fzy_free(&f->scratch.data[i]);
+    }
+    da_free(&f->scratch);
+
+    fzy_truncate(f, 0);
+    da_free(&f->query);
+    da_free(&f->terms);
+    da_free(&f->fresh);
+
+    stretch_free(&f->matches);
+    stretch_free(&f->spare);
     da_free(&f->positions);
 }
 
-void fzy_filter(Fzy *f, Str pattern, Str *items, size_t count) {
-    f->matches.count = 0;
+static int term_equal(Term *t, Str pattern) {
+    return t->pattern.count == pattern.size && !memcmp(t->pattern.data, pattern.data, pattern.size);
+}
 
-    f->positions.count = 0;
-    da_append_many(&f->positions, NULL, pattern.size * count);
+static int term_extends(Term *t, Str pattern) {
+    return t->pattern.count && t->pattern.count < pattern.size &&
+           !memcmp(t->pattern.data, pattern.data, t->pattern.count);
+}
+
+static void term_set(Term *t, Str pattern) {
+    t->pattern.count = 0;
+    da_append_many(&t->pattern, pattern.data, pattern.size);
+
+    t->runes.count = 0;
+    for (size_t i = 0; i < pattern.size;) {
+        uint32_t c = 0;
+        i += utf8_decode(pattern, i, &c);
+        da_append(&t->runes, c);
+    }
+
+    t->ascii = t->runes.count == t->pattern.count;
+    t->kernel = kernel_select(t);
+}
+
+typedef struct {
+    const Term *t;
+    Items items;
+    int direct;
+
+    // The candidates from BEGIN to END are tested, or the items themselves without any
+    const size_t *indices;
+    size_t begin;
+    size_t end;
+
+    size_t *out;
+    size_t count;
+} Scan;
+
+static void *scan_run(void *arg) {
+    Scan *s = arg;
+    s->count = 0;
+    for (size_t i = s->begin; i < s->end; i++) {
+        const size_t index = s->indices ? s->indices[i] : i;
+        const Str item = span_str(s->items.text, s->items.spans[index]);
+        if (fzy_has(s->t, item, s->items.ascii[index], s->direct)) {
+            s->out[s->count++] = index;
+        }
+    }
+    return NULL;
+}
+
+static size_t fzy_threads(const Fzy *f, size_t count, size_t min) {
+    const size_t threads = parallel_threads(count, min);
+    return f->plan.threads && threads > f->plan.threads ? f->plan.threads : threads;
+}
+
+// Write the candidates from BEGIN to END which match the term to OUT in the same order, returning
+// their number. The candidates can be narrowed in place
+static size_t term_filter(Fzy *f, const Term *t, Items items, const size_t *indices, size_t begin,
+                          size_t end, size_t *out) {
+    Scan         scans[PARALLEL_MAX];
+    const size_t count = fzy_threads(f, end - begin, SCAN_CHUNK_MIN);
+    for (size_t i = 0; i < count; i++) {
+        const size_t from = begin + (end - begin) / count * i;
+        scans[i] = (Scan) {
+            .t = t,
+            .items = items,
+            .direct = f->plan.direct,
+            .indices = indices,
+            .begin = from,
+            .end = i + 1 < count ? begin + (end - begin) / count * (i + 1) : end,
+            .out = out + (from - begin),
+        };
+    }
+
+    parallel_run(scans, sizeof(*scans), count, scan_run);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        memmove(out + total, scans[i].out, scans[i].count * sizeof(*out));
+        total += scans[i].count;
+    }
+    return total;
+}
+
+static void term_narrow(Fzy *f, Term *t, Items items) {
+    t->candidates.count =
+        term_filter(f, t, items, t->candidates.data, 0, t->candidates.count, t->candidates.data);
+}
+
+// Append the items matching the pattern, starting FROM the given candidate of the previous term or
+// from the given item for the first term
+static void term_scan(Fzy *f, Term *t, Items items, Term *prev, size_t from) {
+    const size_t end = prev ? prev->candidates.count : items.count;
+    if (from >= end) {
+        return;
+    }
+
+    da_append_many(&t->candidates, NULL, end - from);
+    t->candidates.count += term_filter(f,
+                                       t,
+                                       items,
+                                       prev ? prev->candidates.data : NULL,
+                                       from,
+                                       end,
+                                       t->candidates.data + t->candidates.count);
+}
+
+// Every term is matched independently and caches the items which also matched all the terms
+// before it, so editing the last term rescans only the intersection of the earlier ones
+static void fzy_terms(Fzy *f, Str pattern, Items items) {
+    size_t index = 0;
+    int changed = 0;
+
+    f->length = 0;
+    while (pattern.size) {
+        Str term = str_split(&pattern, ' ');
+        if (!term.size) {
+            continue;
+        }
+
+        if (index == f->terms.count) {
+            da_append(&f->terms, (Term) {0});
+        }
+
+        Term *t = &f->terms.data[index];
+        Term *prev = index ? &f->terms.data[index - 1] : NULL;
+        if (changed || !term_equal(t, term)) {
+            const int extends = !changed && term_extends(t, term);
+            term_set(t, term);
 
+            if (extends) {
+                term_narrow(f, t, items);
+            } else {
+                t->candidates.count = 0;
+                term_scan(f, t, items, prev, 0);
+            }
+            changed = 1;
+        }
+
+        f->length += t->runes.count;
+        index++;
+    }
+
+    fzy_truncate(f, index);
+}
+
+typedef struct {
+    const Fzy *f;
+    Items items;
+
+    // Scratch space of the thread, which is the matcher itself for the first one
+    Fzy *fzy;
+
+    const size_t *indices;
+    size_t begin;
+    size_t end;
+    Match *out;
+} Score;
+
+static void *score_run(void *arg) {
+    Score *s = arg;
+    for (size_t i = s->begin; i < s->end; i++) {
+        const size_t index = s->indices[i];
+        const Str    str = span_str(s->items.text, s->items.spans[index]);
+        const int    ascii = s->items.ascii[index];
+
+        double score = 0;
+        for (size_t j = 0; j < s->f->terms.count; j++) {
+            const Term *t = &s->f->terms.data[j];
+            score += ascii ? t->kernel(s->fzy, t, str) : kernel_generic(s->fzy, t, str);
+        }
+
+        s->out[i - s->begin] = (Match) {.index = index, .key = match_key(score)};
+    }
+    return NULL;
+}
+
+// Move the COUNT best matches to the front, in no particular order
+static void match_select(Match *matches, size_t size, size_t count) {
+    size_t lo = 0;
+    size_t hi = size;
+    while (hi - lo > 1) {
+        const uint64_t a = match_order(matches[lo]);
+        const uint64_t b = match_order(matches[lo + (hi - lo) / 2]);
+        const uint64_t c = match_order(matches[hi - 1]);
+        const uint64_t pivot = max(min(a, b), min(max(a, b), c));
+
+        // Partition into the better matches, the pivot and the worse ones
+        size_t better = lo;
+        size_t worse = hi;
+        for (size_t i = lo; i < worse;) {
+            const Match    match = matches[i];
+            const uint64_t order = match_order(match);
+            if (order < pivot) {
+                matches[i++] = matches[better];
+                matches[better++] = match;
+            } else if (order > pivot) {
+                matches[i] = matches[--worse];
+                matches[worse] = match;
+            } else {
+                i++;
+            }
+        }
+
+        if (count < better) {
+            hi = better;
+        } else if (count <= worse) {
+            return;
+        } else {
+            lo = worse;
+        }
+    }
+}
+
+// Least significant digit radix sort of the matches in rank order, skipping the digits which all of
+// them share, like the high bytes of the index
+static void match_sort(Fzy *f, Match *matches, size_t count) {
+    if (count < MATCH_RADIX_MIN) {
+        qsort(matches, count, sizeof(*matches), match_compare);
+        return;
+    }
+
+    f->spare.count = 0;
+    stretch_append_many(&f->spare, NULL, count);
+
+    size_t counts[8][256] = {0};
     for (size_t i = 0; i < count; i++) {
-        if (fzy_has(pattern, items[i])) {
-            Match match = {0};
-            match.str = items[i];
-            match.positions = &f->positions.data[f->matches.count * pattern.size];
-            match_calculate(&match, f, pattern);
+        const uint64_t order = match_order(matches[i]);
+        for (size_t d = 0; d < 8; d++) {
+            counts[d][(order >> (d * 8)) & 0xFF]++;
+        }
+    }
+
+    Match *from = matches;
+    Match *to = f->spare.data;
+    for (size_t d = 0; d < 8; d++) {
+        size_t offset = 0;
+        int    shared = 0;
+        for (size_t i = 0; i < 256; i++) {
+            const size_t n = counts[d][i];
+            shared |= n == count;
+            counts[d][i] = offset;
+            offset += n;
+        }
+
+        if (shared) {
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            const size_t digit = (match_order(from[i]) >> (d * 8)) & 0xFF;
+            to[counts[d][digit]++] = from[i];
+        }
+
+        Match *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != matches) {
+        memcpy(matches, from, count * sizeof(*matches));
+    }
+}
+
+// Score the given candidates of the last term, and rank the matches
+static void fzy_score(Fzy *f, Items items, const size_t *indices, size_t size) {
+    stretch_append_many(&f->matches, NULL, size);
+
+    Score        scores[PARALLEL_MAX];
+    const size_t count = fzy_threads(f, size, SCORE_CHUNK_MIN);
+    while (f->scratch.count + 1 < count) {
+        da_append(&f->scratch, (Fzy) {0});
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const size_t begin = size / count * i;
+        scores[i] = (Score) {
+            .f = f,
+            .items = items,
+            .fzy = i ? &f->scratch.data[i - 1] : f,
+            .indices = indices,
+            .begin = begin,
+            .end = i + 1 < count ? size / count * (i + 1) : size,
+            .out = f->matches.data + f->matches.count + begin,
+        };
+    }
+
+    parallel_run(scores, sizeof(*scores), count, score_run);
+    f->matches.count += size;
+
+    // Past a page or so the ranking is rarely looked at, so only the best matches are sorted
+    f->ranked = 0;
+    if (f->plan.top && f->matches.count > f->plan.top * 2) {
+        match_select(f->matches.data, f->matches.count, f->plan.top);
+        match_sort(f, f->matches.data, f->plan.top);
+        f->ranked = f->plan.top;
+    } else {
+        fzy_rank(f, f->matches.count);
+    }
+}
+
+void fzy_filter(Fzy *f, Str pattern, Items items) {
+    // Matching is case insensitive, so the terms are cached folded to lower case
+    f->query.count = 0;
+    for (size_t i = 0; i < pattern.size;) {
+        uint32_t c = 0;
+        i += utf8_decode(pattern, i, &c);
+
+        char bytes[4];
+        da_append_many(&f->query, bytes, utf8_encode(utf8_fold(c), bytes));
+    }
+
+    fzy_terms(f, str_new(f->query.data, f->query.count), items);
+
+    // Without any terms every item matches in input order, which is left to the caller to page
+    // through instead of materializing a match per item
+    f->matches.count = 0;
+    f->ranked = 0;
+    if (!f->terms.count) {
+        return;
+    }
+
+    const Term *last = &f->terms.data[f->terms.count - 1];
+    fzy_score(f, items, last->candidates.data, last->candidates.count);
+}
+
+void fzy_update(Fzy *f, Items items, size_t keep) {
+    if (!f->terms.count) {
+        return;
+    }
 
-            da_append(&f->matches, match);
+    // Candidates are kept in input order, so the ones past the unchanged items are at the end
+    size_t from = keep;
+    for (size_t i = 0; i < f->terms.count; i++) {
+        Term *t = &f->terms.data[i];
+        Term *prev = i ? &f->terms.data[i - 1] : NULL;
+
+        while (t->candidates.count && t->candidates.data[t->candidates.count - 1] >= keep) {
+            t->candidates.count--;
         }
+
+        const size_t next = t->candidates.count;
+        term_scan(f, t, items, prev, from);
+        from = next;
     }
 
-    if (pattern.size) {
-        qsort(f->matches.data, f->matches.count, sizeof(*f->matches.data), match_compare);
+    size_t matches = 0;
+    for (size_t i = 0; i < f->matches.count; i++) {
+        if (f->matches.data[i].index < keep) {
+            f->matches.data[matches++] = f->matches.data[i];
+        }
+    }
+    f->matches.count = matches;
+
+    const Term *last = &f->terms.data[f->terms.count - 1];
+    fzy_score(f, items, last->candidates.data + from, last->candidates.count - from);
+}
+
+static int index_compare(const void *a, const void *b) {
+    const size_t ia = *(const size_t *) a;
+    const size_t ib = *(const size_t *) b;
+    return (ia > ib) - (ia < ib);
+}
+
+// Move the candidates to the new indices of their items, and merge in the fresh items which matched
+static void term_remap(Term *t, const size_t *moved, const size_t *fresh, size_t count) {
+    size_t kept = 0;
+    int    sorted = 1;
+    for (size_t i = 0; i < t->candidates.count; i++) {
+        const size_t index = moved[t->candidates.data[i]];
+        if (index != SIZE_MAX) {
+            sorted &= !kept || t->candidates.data[kept - 1] < index;
+            t->candidates.data[kept++] = index;
+        }
+    }
+
+    // Lines only move when the lines around them were reordered
+    if (!sorted) {
+        qsort(t->candidates.data, kept, sizeof(*t->candidates.data), index_compare);
+    }
+
+    da_append_many(&t->candidates, NULL, count);
+    t->candidates.count = kept + count;
+
+    size_t *data = t->candidates.data;
+    for (size_t i = kept, j = count, k = kept + count; j;) {
+        data[--k] = i && data[i - 1] > fresh[j - 1] ? data[--i] : fresh[--j];
+    }
+}
+
+void fzy_remap(Fzy *f, Items items, const size_t *moved, const size_t *fresh, size_t count) {
+    if (!f->terms.count) {
+        return;
+    }
+
+    // Only the fresh items which matched a term are tested for the next one
+    f->fresh.count = 0;
+    if (count) {
+        da_append_many(&f->fresh, fresh, count);
+    }
+
+    for (size_t i = 0; i < f->terms.count; i++) {
+        Term *t = &f->terms.data[i];
+        f->fresh.count =
+            term_filter(f, t, items, f->fresh.data, 0, f->fresh.count, f->fresh.data);
+        term_remap(t, moved, f->fresh.data, f->fresh.count);
+    }
+
+    // The items which did not change keep their score
+    size_t matches = 0;
+    for (size_t i = 0; i < f->matches.count; i++) {
+        const size_t index = moved[f->matches.data[i].index];
+        if (index != SIZE_MAX) {
+            f->matches.data[matches].index = index;
+            f->matches.data[matches++].key = f->matches.data[i].key;
+        }
+    }
+    f->matches.count = matches;
+
+    fzy_score(f, items, f->fresh.data, f->fresh.count);
+}
+
+double fzy_score_of(Match match) {
+    uint32_t bits = match.key & 0x80000000 ? match.key & 0x7FFFFFFF : ~match.key;
+
+    float value = 0;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void fzy_rank(Fzy *f, size_t count) {
+    // The matches past the ranked ones are all worse than them
+    if (count > f->ranked) {
+        match_sort(f, f->matches.data + f->ranked, f->matches.count - f->ranked);
+        f->ranked = f->matches.count;
+    }
+}
+
+size_t fzy_find(const Fzy *f, size_t index) {
+    const Match *matches = f->matches.data;
+    const size_t count = f->matches.count;
+
+    size_t at = 0;
+    while (at < count && matches[at].index != index) {
+        at++;
+    }
+
+    if (at == count) {
+        return SIZE_MAX;
+    }
+
+    if (at < f->ranked) {
+        return at;
+    }
+
+    // The unranked matches land after the ranked ones in their order
+    const uint64_t order = match_order(matches[at]);
+    size_t rank = f->ranked;
+    for (size_t i = f->ranked; i < count; i++) {
+        rank += match_order(matches[i]) < order;
+    }
+    return rank;
+}
+
+void fzy_positions(Fzy *f, Str str, size_t *positions) {
+    for (size_t i = 0; i < f->terms.count; i++) {
+        Term *t = &f->terms.data[i];
+        match_calculate(f, t, str, positions);
+        positions += t->runes.count;
     }
 }
@@ -1,26 +1,97 @@
 #ifndef FZY_H
 #define FZY_H
 
+#include <stdint.h>
+
 #include "da.h"
 #include "str.h"
+#include "stretch.h"
 
+// The score is kept as a key whose unsigned order is the order of the scores, rounded to a float.
+// The index limits the items to 2^32
 typedef struct {
-    Str str;
-    double score;
-    size_t *positions;
+    uint32_t index;
+    uint32_t key;
 } Match;
 
 typedef struct {
+    const char *text;
+    const Span *spans;
+    const char *ascii;
+    size_t count;
+} Items;
+
+// How the items are matched, picked by the caller from the statistics of the items
+typedef struct {
+    // Test short items for the pattern with a plain loop rather than searching for every character
+    int direct;
+
+    // The most threads scanning and scoring the items
+    size_t threads;
+
+    // Rank only this many of the best matches until more are needed, or all of them when zero
+    size_t top;
+} Plan;
+
+typedef struct Fzy Fzy;
+typedef struct Term Term;
+
+typedef double (*Kernel)(Fzy *f, const Term *t, Str str);
+
+struct Term {
+    int ascii;
+    Kernel kernel;
+    DynamicArray(char) pattern;
+    DynamicArray(uint32_t) runes;
+    DynamicArray(size_t) candidates;
+};
+
+struct Fzy {
     DynamicArray(double) B;
     DynamicArray(double) D;
     DynamicArray(double) M;
 
-    DynamicArray(Match) matches;
+    DynamicArray(uint32_t) runes;
+    DynamicArray(size_t) offsets;
+
+    // Scratch space of the threads scoring along with this one, kept across queries
+    DynamicArray(Fzy) scratch;
+
+    DynamicArray(char) query;
+    DynamicArray(Term) terms;
+    DynamicArray(size_t) fresh;
+    size_t length;
+
+    Plan plan;
+    Stretch(Match) matches;
+    Stretch(Match) spare;
+    size_t ranked;
+
     DynamicArray(size_t) positions;
-} Fzy;
+};
 
 void fzy_init(void);
 void fzy_free(Fzy *f);
-void fzy_filter(Fzy *f, Str needle, Str *items, size_t count);
+void fzy_filter(Fzy *f, Str needle, Items items);
+
+// Re-apply the last filtered query after the items past KEEP changed
+void fzy_update(Fzy *f, Items items, size_t keep);
+
+// Re-apply the last filtered query after the items were replaced. MOVED maps every previous item to
+// its new index, or SIZE_MAX when its line is gone, and the COUNT items listed in FRESH are new
+void fzy_remap(Fzy *f, Items items, const size_t *moved, const size_t *fresh, size_t count);
+
+double fzy_score_of(Match match);
+
+// Make sure the first COUNT matches are ranked
+void fzy_rank(Fzy *f, size_t count);
+
+// The rank of the item at INDEX among the matches, or SIZE_MAX when it does not match, without
+// ranking any more of them
+size_t fzy_find(const Fzy *f, size_t index);
+
+// Calculate the byte offsets of the characters matching every term of the last filtered query,
+// which are only needed for the results being displayed
+void fzy_positions(Fzy *f, Str str, size_t *positions);
 
 #endif // FZY_H
@@ -1,13 +1,144 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "app.h"
 
-int main(void) {
-    App app = {0};
+static void usage(FILE *f) {
+    fprintf(f, "Usage: menu [OPTIONS]\n");
+    fprintf(f, "Options:\n");
+    fprintf(f, "    --help             Show this help message\n");
+    fprintf(f, "    --delimiter CHAR   Field delimiter for --nth (default: tab)\n");
+    fprintf(f, "    --nth N[..[M]]     Match only the fields N to M of every line\n");
+    fprintf(f, "    --watch FILE       Read the items from FILE and reload it when it changes\n");
+    fprintf(f, "    --unique           Drop duplicate lines, keeping the first occurrence\n");
+    fprintf(f, "    --build-index FILE Write the items of FILE (- for stdin) to the index at -o\n");
+    fprintf(f, "    -o INDEX           Output path for --build-index\n");
+    fprintf(f, "    --index INDEX      Read the items from an index written by --build-index\n");
+    fprintf(f, "    --plan             Print how every query is matched and its cost to stderr\n");
+}
+
+static int parse_nth(App *a, const char *arg) {
+    char *end = NULL;
+    a->nth_first = strtoul(arg, &end, 10);
+    a->nth_last = a->nth_first;
+
+    if (!strncmp(end, "..", 2)) {
+        if (end[2]) {
+            a->nth_last = strtoul(end + 2, &end, 10);
+        } else {
+            a->nth_last = SIZE_MAX;
+            end += 2;
+        }
+    }
+
+    return a->nth_first && a->nth_first <= a->nth_last && !*end;
+}
+
+static const char *parse_value(int *i, int argc, char **argv) {
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: expected argument for '%s'\n", argv[*i]);
+        return NULL;
+    }
+
+    return argv[++*i];
+}
+
+static int parse_args(App *a, int argc, char **argv) {
+    a->delimiter = '\t';
+
+    for (int i = 1; i < argc; i++) {
+        const char *flag = argv[i];
+        if (!strcmp(flag, "--help")) {
+            usage(stdout);
+            exit(0);
+        } else if (!strcmp(flag, "--unique")) {
+            a->unique = true;
+        } else if (!strcmp(flag, "--plan")) {
+            a->plan = true;
+        } else if (!strcmp(flag, "--delimiter")) {
+            const char *arg = parse_value(&i, argc, argv);
+            if (!arg) {
+                return 0;
+            }
+
+            if (strlen(arg) != 1) {
+                fprintf(stderr, "Error: delimiter must be a single character\n");
+                return 0;
+            }
+            a->delimiter = *arg;
+        } else if (!strcmp(flag, "--nth")) {
+            const char *arg = parse_value(&i, argc, argv);
+            if (!arg) {
+                return 0;
+            }
+
+            if (!parse_nth(a, arg)) {
+                fprintf(stderr, "Error: invalid field range '%s'\n", arg);
+                return 0;
+            }
+        } else if (!strcmp(flag, "--build-index")) {
+            a->build_index = parse_value(&i, argc, argv);
+            if (!a->build_index) {
+                return 0;
+            }
+        } else if (!strcmp(flag, "-o")) {
+            a->output = parse_value(&i, argc, argv);
+            if (!a->output) {
+                return 0;
+            }
+        } else if (!strcmp(flag, "--index")) {
+            a->index = parse_value(&i, argc, argv);
+            if (!a->index) {
+                return 0;
+            }
+        } else if (!strcmp(flag, "--watch")) {
+            a->watch = parse_value(&i, argc, argv);
+            if (!a->watch) {
+                return 0;
+            }
+        } else {
+            fprintf(stderr, "Error: unknown flag '%s'\n", flag);
+            return 0;
+        }
+    }
+
+    if (a->build_index && !a->output) {
+        fprintf(stderr, "Error: expected an output path for the index\n");
+        return 0;
+    }
+
+    if (a->index && (a->watch || a->build_index)) {
+        fprintf(stderr, "Error: the items can only come from one source\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    App app = {.watch_fd = -1};
+    if (!parse_args(&app, argc, argv)) {
+        usage(stderr);
+        return 1;
+    }
+
+    if (app.build_index) {
+        const int ok = app_build(&app);
+        app_free(&app);
+        return !ok;
+    }
+
     if (!app_init(&app)) {
         app_free(&app);
         return 1;
     }
 
     app_loop(&app);
+
+    // Whatever reads the selection waits for stdout to close, which need not wait for the teardown
+    fclose(stdout);
     app_free(&app);
     return 0;
 }
@@ -0,0 +1,1033 @@
+#ifdef __SSE2__
+#    include <emmintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "da.h"
+#include "fzy.h"
+#include "menu.h"
+#include "parallel.h"
+#include "stretch.h"
+#include "utf8.h"
+
+// Open addressing set of the items, by the contents of their line
+typedef struct {
+    size_t *slots; // Index of the item plus one, or zero when empty
+    size_t capacity;
+    size_t count;
+} Set;
+
+// The index is laid out as this header followed by the buffer, padded to 8 bytes, then the items,
+// the fields if any and the ASCII flags, so every array can be used in place once mapped
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t span_size;
+    uint64_t count;
+    uint64_t size;
+    uint64_t duplicates;
+    uint64_t nth_first;
+    uint64_t nth_last;
+    char     delimiter;
+    char     unique;
+    char     padding[6];
+} Index;
+
+#define INDEX_MAGIC   "MENUIDX"
+#define INDEX_VERSION 2
+
+#define index_align(n) (((n) + 7) & ~(size_t) 7)
+
+// Inputs are only split in parallel in chunks of at least this many bytes
+#define MENU_CHUNK_MIN (1 << 22)
+
+#define MENU_READ_SIZE (1 << 16)
+
+// Items are tested for the pattern with a plain loop while most of them are at most this long
+#define MENU_DIRECT_MAX 16
+
+// Matching uses every CPU, and ranks only the best matches, from this many items on
+#define MENU_PARALLEL_MIN (1 << 16)
+#define MENU_PARTIAL_MIN  (1 << 14)
+#define MENU_PARTIAL_TOP  256
+
+// Matches keep the index of their item in 32 bits, so the lines past this many are dropped
+#define MENU_ITEMS_MAX UINT32_MAX
+
+// Items sampled to estimate the share of duplicates when they are not dropped
+#define MENU_SAMPLE 1024
+
+// Cheap statistics of the keys of the items, which pick how every query is matched
+typedef struct {
+    size_t count;
+    size_t bytes;
+    size_t ascii;
+    size_t lengths[65]; // Keys by the bit length of their size
+
+    // The share of duplicate lines, which is only reported
+    size_t sampled;
+    double duplicates;
+} Stats;
+
+struct Menu {
+    // Mapped index the arrays below point into, until the items are modified
+    void  *map;
+    size_t map_size;
+
+    Stretch(char) buffer;
+    Stretch(Span) items;
+    Stretch(Span) fields;
+    Stretch(char) ascii;
+
+    char   delimiter;
+    size_t nth_first;
+    size_t nth_last;
+
+    int    unique;
+    size_t duplicates;
+    Set    lines;
+
+    Stats stats;
+    FILE *debug;
+
+    Fzy fzy;
+    DynamicArray(char) query;
+    DynamicArray(size_t) positions;
+
+    // The new index of every item before the last replace
+    DynamicArray(size_t) moved;
+};
+
+static Span menu_field(Menu *m, Span line) {
+    const char *start = m->buffer.data + line.offset;
+    const char *end = start + line.size;
+
+    for (size_t i = 1; i < m->nth_first && start < end; i++) {
+        const char *next = memchr(start, m->delimiter, end - start);
+        start = next ? next + 1 : end;
+    }
+
+    const char *stop = start;
+    for (size_t i = m->nth_first; i <= m->nth_last && stop < end; i++) {
+        const char *next = memchr(stop, m->delimiter, end - stop);
+        if (!next || i == m->nth_last) {
+            stop = next ? next : end;
+            break;
+        }
+        stop = next + 1;
+    }
+
+    return span_new(start - m->buffer.data, stop - start);
+}
+
+static const Span *menu_keys(const Menu *m) {
+    return m->nth_first ? m->fields.data : m->items.data;
+}
+
+static Items menu_view(const Menu *m) {
+    return (Items) {
+        .text = m->buffer.data,
+        .spans = menu_keys(m),
+        .ascii = m->ascii.data,
+        .count = m->items.count,
+    };
+}
+
+#define stretch_own(l)                                                                             \
+    do {                                                                                           \
+        void  *data = (l)->data;                                                                   \
+        size_t count = (l)->count;                                                                 \
+        memset((l), 0, sizeof(*(l)));                                                              \
+        if (count) {                                                                               \
+            stretch_append_many((l), data, count);                                                 \
+        }                                                                                          \
+    } while (0)
+
+// Copy the arrays out of the mapped index before they are modified
+static void menu_own(Menu *m) {
+    if (m->map) {
+        stretch_own(&m->buffer);
+        stretch_own(&m->items);
+        stretch_own(&m->fields);
+        stretch_own(&m->ascii);
+
+        munmap(m->map, m->map_size);
+        m->map = NULL;
+        m->map_size = 0;
+    }
+}
+
+static void menu_clear(Menu *m) {
+    if (m->map) {
+        munmap(m->map, m->map_size);
+        m->map = NULL;
+        m->map_size = 0;
+        memset(&m->buffer, 0, sizeof(m->buffer));
+        memset(&m->items, 0, sizeof(m->items));
+        memset(&m->fields, 0, sizeof(m->fields));
+        memset(&m->ascii, 0, sizeof(m->ascii));
+    } else {
+        stretch_free(&m->buffer);
+        stretch_free(&m->items);
+        stretch_free(&m->fields);
+        stretch_free(&m->ascii);
+    }
+
+    free(m->lines.slots);
+    memset(&m->lines, 0, sizeof(m->lines));
+    m->duplicates = 0;
+    memset(&m->stats, 0, sizeof(m->stats));
+}
+
+static uint64_t menu_hash(Str str) {
+    uint64_t hash = 0x9E3779B97F4A7C15 ^ str.size;
+
+    size_t i = 0;
+    for (; i + 8 <= str.size; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, str.data + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCD;
+        hash ^= hash >> 32;
+    }
+
+    uint64_t word = 0;
+    memcpy(&word, str.data + i, str.size - i);
+    hash = (hash ^ word) * 0xC4CEB9FE1A85EC53;
+    return hash ^ (hash >> 29);
+}
+
+// Insert the item at INDEX with the given line, unless an item with the same line is already there
+static int menu_insert(Menu *m, Str line, size_t index) {
+    const size_t mask = m->lines.capacity - 1;
+    for (size_t i = menu_hash(line) & mask;; i = (i + 1) & mask) {
+        const size_t slot = m->lines.slots[i];
+        if (!slot) {
+            m->lines.slots[i] = index + 1;
+            m->lines.count++;
+            return 1;
+        }
+
+        const Str other = span_str(m->buffer.data, m->items.data[slot - 1]);
+        if (other.size == line.size && !memcmp(other.data, line.data, line.size)) {
+            return 0;
+        }
+    }
+}
+
+// Make room for COUNT more items, keeping the set at most half full
+static void menu_reserve(Menu *m, size_t count) {
+    if (m->lines.slots && (m->items.count + count) * 2 <= m->lines.capacity) {
+        return;
+    }
+
+    size_t capacity = DA_INIT_CAP;
+    while (capacity < (m->items.count + count) * 2) {
+        capacity *= 2;
+    }
+
+    free(m->lines.slots);
+    m->lines.slots = calloc(capacity, sizeof(*m->lines.slots));
+    m->lines.capacity = capacity;
+    m->lines.count = 0;
+    assert(m->lines.slots);
+
+    for (size_t i = 0; i < m->items.count; i++) {
+        menu_insert(m, span_str(m->buffer.data, m->items.data[i]), i);
+    }
+}
+
+#define span_within(s, n) ((s).offset <= (n) && (s).size <= (n) - (s).offset)
+
+// Account for the items up to COUNT, returning whether all of them lie within SIZE bytes of text
+static int stats_add(
+    Stats *s, const Span *items, const Span *keys, const char *ascii, size_t count, size_t size) {
+    int valid = 1;
+    for (size_t i = s->count; i < count; i++) {
+        valid &= span_within(items[i], size) && span_within(keys[i], size);
+
+        const size_t length = keys[i].size;
+        s->bytes += length;
+        s->ascii += ascii[i];
+        s->lengths[length ? 64 - __builtin_clzll(length) : 0]++;
+    }
+    s->count = count;
+    return valid;
+}
+
+// Account for the items added since the last plan
+static void menu_account(Menu *m) {
+    Stats *s = &m->stats;
+    stats_add(s, m->items.data, menu_keys(m), m->ascii.data, m->items.count, m->buffer.count);
+
+    if (m->unique) {
+        const size_t lines = s->count + m->duplicates;
+        s->sampled = s->count;
+        s->duplicates = lines ? (double) m->duplicates / lines : 0;
+        return;
+    }
+
+    // The duplicates are only reported by the plan, so they are only estimated when debugging, from
+    // the hashes of evenly spaced items once the items doubled
+    if (m->debug && s->count && s->count >= s->sampled * 2) {
+        uint64_t     hashes[MENU_SAMPLE * 2] = {0};
+        const size_t sample = s->count < MENU_SAMPLE ? s->count : MENU_SAMPLE;
+
+        size_t duplicates = 0;
+        for (size_t i = 0; i < sample; i++) {
+            const Span     item = m->items.data[i * (s->count / sample)];
+            const uint64_t hash = menu_hash(span_str(m->buffer.data, item)) | 1;
+
+            size_t j = hash & (MENU_SAMPLE * 2 - 1);
+            while (hashes[j] && hashes[j] != hash) {
+                j = (j + 1) & (MENU_SAMPLE * 2 - 1);
+            }
+
+            duplicates += hashes[j] == hash;
+            hashes[j] = hash;
+        }
+
+        s->sampled = s->count;
+        s->duplicates = (double) duplicates / sample;
+    }
+}
+
+// The length below which at least PERCENT of the keys are
+static size_t menu_percentile(const Stats *s, size_t percent) {
+    size_t count = 0;
+    for (size_t i = 0; i < 65; i++) {
+        count += s->lengths[i];
+        if (count * 100 >= s->count * percent) {
+            return i ? (size_t) 1 << i : 1;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static Plan menu_plan(Menu *m) {
+    menu_account(m);
+    const Stats *s = &m->stats;
+
+    Plan plan = {0};
+
+    // Searching for every character skips ahead in long paths, but only adds overhead to the short
+    // names of commands. Items which are not ASCII are decoded either way
+    plan.direct = menu_percentile(s, 50) <= MENU_DIRECT_MAX && s->ascii * 2 >= s->count;
+
+    plan.threads = s->count >= MENU_PARALLEL_MIN ? parallel_cpus() : 1;
+    plan.top = s->count >= MENU_PARTIAL_MIN ? MENU_PARTIAL_TOP : 0;
+    return plan;
+}
+
+static double menu_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static void menu_report(const Menu *m, double cost) {
+    const Stats *s = &m->stats;
+    const Plan  *p = &m->fzy.plan;
+
+    fprintf(m->debug,
+            "plan: %zu items, median < %zu bytes, 90%% < %zu bytes, %.1f%% ascii, "
+            "%.1f%% duplicates; %s scan, %zu thread%s, ",
+            s->count,
+            menu_percentile(s, 50),
+            menu_percentile(s, 90),
+            s->count ? s->ascii * 100.0 / s->count : 100.0,
+            s->duplicates * 100,
+            p->direct ? "direct" : "prefilter",
+            p->threads,
+            p->threads == 1 ? "" : "s");
+
+    if (!m->fzy.terms.count) {
+        fprintf(m->debug, "no ranking");
+    } else if (m->fzy.ranked < m->fzy.matches.count) {
+        fprintf(m->debug, "top %zu ranked", m->fzy.ranked);
+    } else {
+        fprintf(m->debug, "full ranking");
+    }
+
+    fprintf(m->debug, "; %zu matches in %.2f ms\n", menu_count(m), cost);
+}
+
+static void menu_filter(Menu *m) {
+    m->fzy.plan = menu_plan(m);
+
+    const double start = m->debug ? menu_clock() : 0;
+    fzy_filter(&m->fzy, str_new(m->query.data, m->query.count), menu_view(m));
+    if (m->debug) {
+        menu_report(m, menu_clock() - start);
+    }
+}
+
+// Count the non empty lines, which end at a newline not preceded by another one
+static size_t menu_count_lines(Str str) {
+    size_t count = 0;
+    size_t i = 0;
+    int after = 1;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= str.size; i += 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *) (str.data + i));
+        const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        const unsigned prev = (mask << 1) | after;
+        count += __builtin_popcount(mask & ~prev);
+        after = mask >> 15;
+    }
+#endif
+
+    for (; i < str.size; i++) {
+        const int end = str.data[i] == '\n';
+        count += end && !after;
+        after = end;
+    }
+
+    return count + !after;
+}
+
+typedef struct {
+    Menu  *menu;
+    Str    chunk;
+    size_t index;
+    size_t count;
+} Chunk;
+
+static void *menu_chunk_count(void *arg) {
+    Chunk *c = arg;
+    c->count = menu_count_lines(c->chunk);
+    return NULL;
+}
+
+// Write the items of the chunk starting at its index, which every chunk before it has left room for
+static void *menu_chunk_split(void *arg) {
+    const Chunk *c = arg;
+    Menu *m = c->menu;
+
+    Str contents = c->chunk;
+    size_t index = c->index;
+    while (contents.size && index < c->index + c->count) {
+        const Str line = str_split(&contents, '\n');
+        if (line.size) {
+            const Span item = span_new(line.data - m->buffer.data, line.size);
+            m->items.data[index] = item;
+
+            Span key = item;
+            if (m->nth_first) {
+                key = menu_field(m, item);
+                m->fields.data[index] = key;
+            }
+
+            // Only the items which are not plain ASCII pay for decoding while matching
+            m->ascii.data[index] = utf8_ascii(span_str(m->buffer.data, key));
+            index++;
+        }
+    }
+
+    return NULL;
+}
+
+// Cut the contents into chunks ending at line boundaries, a thread's worth of work each
+static size_t menu_chunks(Menu *m, Str contents, Chunk *chunks) {
+    const size_t count = parallel_threads(contents.size, MENU_CHUNK_MIN);
+    const char *end = contents.data + contents.size;
+    const char *start = contents.data;
+    for (size_t i = 0; i < count; i++) {
+        const char *stop = end;
+        if (i + 1 < count) {
+            stop = contents.data + contents.size / count * (i + 1);
+            if (stop < start) {
+                stop = start;
+            }
+
+            const char *newline = memchr(stop, '\n', end - stop);
+            stop = newline ? newline + 1 : end;
+        }
+
+        chunks[i] = (Chunk) {.menu = m, .chunk = str_new(start, stop - start)};
+        start = stop;
+    }
+
+    return count;
+}
+
+// Split the lines of the buffer starting FROM the given offset into items. Returns 0 when there
+// were more lines than fit, the ones past MENU_ITEMS_MAX being dropped
+static int menu_lines(Menu *m, size_t from) {
+    Chunk        chunks[PARALLEL_MAX];
+    const Str    contents = str_new(m->buffer.data + from, m->buffer.count - from);
+    const size_t count = menu_chunks(m, contents, chunks);
+    parallel_run(chunks, sizeof(*chunks), count, menu_chunk_count);
+
+    // Every chunk writes its items after the ones of the chunks before it, in the input order
+    int    fits = 1;
+    size_t index = m->items.count;
+    for (size_t i = 0; i < count; i++) {
+        if (chunks[i].count > MENU_ITEMS_MAX - index) {
+            chunks[i].count = MENU_ITEMS_MAX - index;
+            fits = 0;
+        }
+
+        chunks[i].index = index;
+        index += chunks[i].count;
+    }
+
+    const size_t added = index - m->items.count;
+    stretch_append_many(&m->items, NULL, added);
+    stretch_append_many(&m->ascii, NULL, added);
+    if (m->nth_first) {
+        stretch_append_many(&m->fields, NULL, added);
+    }
+
+    parallel_run(chunks, sizeof(*chunks), count, menu_chunk_split);
+
+    if (m->unique) {
+        menu_reserve(m, added);
+
+        // Compact the new items in place, keeping the first occurrence of each line
+        size_t write = m->items.count;
+        for (size_t read = m->items.count; read < index; read++) {
+            if (!menu_insert(m, span_str(m->buffer.data, m->items.data[read]), write)) {
+                m->duplicates++;
+                continue;
+            }
+
+            m->items.data[write] = m->items.data[read];
+            m->ascii.data[write] = m->ascii.data[read];
+            if (m->nth_first) {
+                m->fields.data[write] = m->fields.data[read];
+            }
+            write++;
+        }
+        index = write;
+    }
+
+    m->items.count = index;
+    m->ascii.count = index;
+    if (m->nth_first) {
+        m->fields.count = index;
+    }
+    return fits;
+}
+
+// Split the lines of the buffer starting FROM the given offset into items, and re-apply the query
+// to the items past KEEP
+static int menu_split(Menu *m, size_t from, size_t keep) {
+    const int fits = menu_lines(m, from);
+    m->fzy.plan = menu_plan(m);
+    fzy_update(&m->fzy, menu_view(m), keep);
+    return fits;
+}
+
+Menu *menu_new(void) {
+    static int initialized = 0;
+    if (!initialized) {
+        fzy_init();
+        initialized = 1;
+    }
+
+    Menu *m = calloc(1, sizeof(*m));
+    assert(m);
+    return m;
+}
+
+void menu_free(Menu *m) {
+    if (m) {
+        menu_clear(m);
+        fzy_free(&m->fzy);
+        da_free(&m->query);
+        da_free(&m->positions);
+        da_free(&m->moved);
+        free(m);
+    }
+}
+
+void menu_fields(Menu *m, char delimiter, size_t first, size_t last) {
+    menu_own(m);
+    m->delimiter = delimiter;
+    m->nth_first = first;
+    m->nth_last = last;
+
+    // Lines loaded before the fields were selected match as a whole
+    if (first) {
+        for (size_t i = m->fields.count; i < m->items.count; i++) {
+            stretch_append(&m->fields, m->items.data[i]);
+        }
+    }
+}
+
+void menu_unique(Menu *m, int unique) {
+    m->unique = unique;
+    if (unique) {
+        menu_reserve(m, 0);
+    }
+}
+
+void menu_debug(Menu *m, FILE *f) {
+    m->debug = f;
+}
+
+size_t menu_duplicates(const Menu *m) {
+    return m->duplicates;
+}
+
+// Read the rest of the stream into the buffer
+static int menu_read(Menu *m, FILE *f) {
+    while (!feof(f)) {
+        stretch_append_many(&m->buffer, NULL, MENU_READ_SIZE);
+        m->buffer.count += fread(m->buffer.data + m->buffer.count, sizeof(char), MENU_READ_SIZE, f);
+        if (ferror(f)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int menu_load(Menu *m, FILE *f) {
+    menu_own(m);
+    const size_t from = m->buffer.count;
+    const size_t keep = m->items.count;
+    if (!menu_read(m, f)) {
+        return 0;
+    }
+
+    return menu_split(m, from, keep);
+}
+
+int menu_append(Menu *m, const char *data, size_t size) {
+    menu_own(m);
+    const size_t from = m->buffer.count;
+    const size_t keep = m->items.count;
+    stretch_append_many(&m->buffer, data, size);
+    return menu_split(m, from, keep);
+}
+
+// How many lines the diff looks past a changed line for the place where both files agree again
+#define DIFF_AHEAD 16
+
+// A line of the previous items, and the ones equal to it which were not matched to a new line yet
+typedef struct {
+    uint64_t hash;
+    size_t   first;
+    size_t   next;
+    size_t   last;
+} Line;
+
+static int menu_equal(Str a, Str b) {
+    return a.size == b.size && !memcmp(a.data, b.data, a.size);
+}
+
+// Find the slot of the line, or the empty one where it belongs
+static Line *menu_line(Line *lines, size_t mask, const char *text, const Span *items, Str line,
+                       uint64_t hash) {
+    for (size_t j = hash & mask;; j = (j + 1) & mask) {
+        Line *l = &lines[j];
+        if (!l->first) {
+            return l;
+        }
+
+        if (l->hash == hash && menu_equal(span_str(text, items[l->first - 1]), line)) {
+            return l;
+        }
+    }
+}
+
+// Map every previous item to a new item with the same line, and list the new items whose line is
+// not among the previous ones
+static size_t menu_diff(Menu *m, const char *text, const Span *items, size_t count, size_t *fresh) {
+    const char  *data = m->buffer.data;
+    const Span  *added = m->items.data;
+    const size_t size = m->items.count;
+    size_t      *moved = m->moved.data;
+
+#define old_line(i) span_str(text, items[i])
+#define new_line(j) span_str(data, added[j])
+
+    // Files mostly change in a few places, so both are walked in step first, and only the lines
+    // which are left over go through the table
+    size_t *left = malloc((count + 1) * sizeof(*left));
+    assert(left);
+
+    size_t i = 0, j = 0, lefts = 0, rights = 0;
+    while (i < count && j < size) {
+        if (menu_equal(old_line(i), new_line(j))) {
+            moved[i++] = j++;
+            continue;
+        }
+
+        size_t k = 1;
+        for (; k <= DIFF_AHEAD; k++) {
+            if (j + k < size && menu_equal(old_line(i), new_line(j + k))) {
+                for (size_t end = j + k; j < end; j++) {
+                    fresh[rights++] = j;
+                }
+                break;
+            }
+
+            if (i + k < count && menu_equal(old_line(i + k), new_line(j))) {
+                for (size_t end = i + k; i < end; i++) {
+                    left[lefts++] = i;
+                }
+                break;
+            }
+        }
+
+        if (k > DIFF_AHEAD) {
+            left[lefts++] = i++;
+            fresh[rights++] = j++;
+        }
+    }
+
+    while (i < count) {
+        left[lefts++] = i++;
+    }
+
+    while (j < size) {
+        fresh[rights++] = j++;
+    }
+
+    size_t capacity = DA_INIT_CAP;
+    while (capacity < lefts * 2) {
+        capacity *= 2;
+    }
+
+    const size_t mask = capacity - 1;
+    Line     *lines = calloc(capacity, sizeof(*lines));
+    size_t   *same = malloc((count + 1) * sizeof(*same));
+    uint64_t *hashes = malloc((max(lefts, rights) + 1) * sizeof(*hashes));
+    assert(lines && same && hashes);
+
+    // The table is far larger than the cache, so the slots are fetched a few lines ahead
+    for (size_t k = 0; k < lefts; k++) {
+        hashes[k] = menu_hash(old_line(left[k]));
+    }
+
+    for (size_t k = 0; k < lefts; k++) {
+        if (k + DIFF_AHEAD < lefts) {
+            __builtin_prefetch(&lines[hashes[k + DIFF_AHEAD] & mask]);
+        }
+
+        const size_t at = left[k];
+        same[at] = SIZE_MAX;
+        moved[at] = SIZE_MAX;
+
+        Line *l = menu_line(lines, mask, text, items, old_line(at), hashes[k]);
+        if (l->first) {
+            same[l->last] = at;
+            l->last = at;
+        } else {
+            *l = (Line) {.hash = hashes[k], .first = at + 1, .next = at, .last = at};
+        }
+    }
+
+    for (size_t k = 0; k < rights; k++) {
+        hashes[k] = menu_hash(new_line(fresh[k]));
+    }
+
+    // The new lines which are left are in order, so the fresh ones are narrowed down in place
+    size_t fresh_count = 0;
+    for (size_t k = 0; k < rights; k++) {
+        if (k + DIFF_AHEAD < rights) {
+            __builtin_prefetch(&lines[hashes[k + DIFF_AHEAD] & mask]);
+        }
+
+        const size_t at = fresh[k];
+        Line        *l = menu_line(lines, mask, text, items, new_line(at), hashes[k]);
+        if (l->first && l->next != SIZE_MAX) {
+            moved[l->next] = at;
+            l->next = same[l->next];
+        } else {
+            fresh[fresh_count++] = at;
+        }
+    }
+
+#undef old_line
+#undef new_line
+
+    free(left);
+    free(lines);
+    free(same);
+    free(hashes);
+    return fresh_count;
+}
+
+// The lines of the previous items, set aside to find the ones which are still there
+typedef struct {
+    Stretch(char) buffer;
+    Stretch(Span) items;
+} Previous;
+
+static Previous menu_aside(Menu *m) {
+    menu_own(m);
+
+    Previous p;
+    memcpy(&p.buffer, &m->buffer, sizeof(p.buffer));
+    memcpy(&p.items, &m->items, sizeof(p.items));
+    memset(&m->buffer, 0, sizeof(m->buffer));
+    memset(&m->items, 0, sizeof(m->items));
+    return p;
+}
+
+static void menu_restore(Menu *m, Previous *p) {
+    stretch_free(&m->buffer);
+    memcpy(&m->buffer, &p->buffer, sizeof(m->buffer));
+    memcpy(&m->items, &p->items, sizeof(m->items));
+}
+
+// Split the new contents of the buffer into items, matching only the lines which were not among the
+// previous items, and return the number of items whose line was already there
+static size_t menu_swap(Menu *m, Previous *p) {
+    m->fields.count = 0;
+    m->ascii.count = 0;
+    m->duplicates = 0;
+    m->lines.count = 0;
+    memset(&m->stats, 0, sizeof(m->stats));
+    if (m->lines.slots) {
+        memset(m->lines.slots, 0, m->lines.capacity * sizeof(*m->lines.slots));
+    }
+
+    menu_lines(m, 0);
+
+    m->moved.count = 0;
+    da_append_many(&m->moved, NULL, p->items.count);
+    m->moved.count = p->items.count;
+
+    DynamicArray(size_t) fresh = {0};
+    da_append_many(&fresh, NULL, m->items.count);
+
+    // Only the new lines and the ones which changed are matched again
+    const size_t count = menu_diff(m, p->buffer.data, p->items.data, p->items.count, fresh.data);
+    stretch_free(&p->buffer);
+    stretch_free(&p->items);
+
+    m->fzy.plan = menu_plan(m);
+    fzy_remap(&m->fzy, menu_view(m), m->moved.data, fresh.data, count);
+    da_free(&fresh);
+    return m->items.count - count;
+}
+
+size_t menu_replace(Menu *m, const char *data, size_t size) {
+    Previous p = menu_aside(m);
+    stretch_append_many(&m->buffer, data, size);
+    return menu_swap(m, &p);
+}
+
+int menu_reload(Menu *m, FILE *f) {
+    Previous p = menu_aside(m);
+    if (!menu_read(m, f)) {
+        menu_restore(m, &p);
+        return 0;
+    }
+
+    menu_swap(m, &p);
+    return 1;
+}
+
+size_t menu_moved(const Menu *m, size_t item) {
+    return item < m->moved.count ? m->moved.data[item] : SIZE_MAX;
+}
+
+static int menu_write(FILE *f, const void *data, size_t size) {
+    return !size || fwrite(data, size, 1, f) == 1;
+}
+
+int menu_save(const Menu *m, const char *path) {
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int) sizeof(temp)) {
+        return 0;
+    }
+
+    FILE *f = fopen(temp, "wb");
+    if (!f) {
+        return 0;
+    }
+
+    Index index = {
+        .magic = INDEX_MAGIC,
+        .version = INDEX_VERSION,
+        .span_size = sizeof(Span),
+        .count = m->items.count,
+        .size = m->buffer.count,
+        .duplicates = m->duplicates,
+        .nth_first = m->nth_first,
+        .nth_last = m->nth_last,
+        .delimiter = m->delimiter,
+        .unique = m->unique,
+    };
+
+    static const char padding[8] = {0};
+    int ok = menu_write(f, &index, sizeof(index)) &&
+             menu_write(f, m->buffer.data, m->buffer.count) &&
+             menu_write(f, padding, index_align(m->buffer.count) - m->buffer.count) &&
+             menu_write(f, m->items.data, m->items.count * sizeof(Span));
+
+    if (ok && m->nth_first) {
+        ok = menu_write(f, m->fields.data, m->fields.count * sizeof(Span));
+    }
+
+    if (ok) {
+        ok = menu_write(f, m->ascii.data, m->ascii.count);
+    }
+
+    // Readers which already mapped the index keep the previous file
+    if (fclose(f) || !ok || rename(temp, path)) {
+        remove(temp);
+        return 0;
+    }
+
+    return 1;
+}
+
+int menu_open(Menu *m, const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st = {0};
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(Index)) {
+        close(fd);
+        return 0;
+    }
+
+    const size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    Index index = {0};
+    memcpy(&index, map, sizeof(index));
+
+    const size_t spans = index.nth_first ? 2 : 1;
+    const int valid = !memcmp(index.magic, INDEX_MAGIC, sizeof(index.magic)) &&
+                      index.version == INDEX_VERSION && index.span_size == sizeof(Span) &&
+                      index.size <= size && index.count <= size / sizeof(Span) &&
+                      index.count <= MENU_ITEMS_MAX &&
+                      sizeof(Index) + index_align(index.size) +
+                              index.count * (spans * sizeof(Span) + 1) <=
+                          size;
+    Span *items = (Span *) (map + sizeof(Index) + index_align(index.size));
+    Span *keys = index.nth_first ? items + index.count : items;
+    char *ascii = (char *) (items + index.count * spans);
+
+    // The statistics are gathered while checking that every span lies within the buffer
+    Stats stats = {0};
+    if (!valid || !stats_add(&stats, items, keys, ascii, index.count, index.size)) {
+        munmap(map, size);
+        return 0;
+    }
+
+    menu_clear(m);
+    m->map = map;
+    m->map_size = size;
+    m->stats = stats;
+
+    m->buffer.data = map + sizeof(Index);
+    m->buffer.count = index.size;
+
+    m->items.data = items;
+    m->items.count = index.count;
+
+    if (index.nth_first) {
+        m->fields.data = keys;
+        m->fields.count = index.count;
+    }
+
+    m->ascii.data = ascii;
+    m->ascii.count = index.count;
+
+    m->delimiter = index.delimiter;
+    m->nth_first = index.nth_first;
+    m->nth_last = index.nth_last;
+    m->duplicates = index.duplicates;
+
+    // The set of lines is only rebuilt from the mapped items once more are added, so opening the
+    // index does not pay for hashing all of them
+    m->unique = m->unique || index.unique;
+
+    m->fzy.plan = menu_plan(m);
+    fzy_update(&m->fzy, menu_view(m), 0);
+    return 1;
+}
+
+void menu_query(Menu *m, const char *query, size_t size) {
+    m->query.count = 0;
+    if (size) {
+        da_append_many(&m->query, query, size);
+    }
+
+    menu_filter(m);
+}
+
+size_t menu_count(const Menu *m) {
+    return m->fzy.terms.count ? m->fzy.matches.count : m->items.count;
+}
+
+size_t menu_items(const Menu *m) {
+    return m->items.count;
+}
+
+size_t menu_item(Menu *m, size_t index) {
+    if (!m->fzy.terms.count) {
+        return index;
+    }
+
+    fzy_rank(&m->fzy, index + 1);
+    return m->fzy.matches.data[index].index;
+}
+
+size_t menu_rank(const Menu *m, size_t item) {
+    if (!m->fzy.terms.count) {
+        return item < m->items.count ? item : SIZE_MAX;
+    }
+
+    return fzy_find(&m->fzy, item);
+}
+
+int menu_result(Menu *m, size_t index, MenuResult *r) {
+    if (index >= menu_count(m)) {
+        return 0;
+    }
+
+    m->positions.count = 0;
+    if (m->fzy.terms.count) {
+        fzy_rank(&m->fzy, index + 1);
+
+        const Match match = m->fzy.matches.data[index];
+        const Span item = m->items.data[match.index];
+        const Span key = menu_keys(m)[match.index];
+
+        da_append_many(&m->positions, NULL, m->fzy.length);
+        fzy_positions(&m->fzy, span_str(m->buffer.data, key), m->positions.data);
+
+        m->positions.count = m->fzy.length;
+        for (size_t i = 0; i < m->positions.count; i++) {
+            m->positions.data[i] += key.offset - item.offset;
+        }
+
+        r->data = m->buffer.data + item.offset;
+        r->size = item.size;
+        r->score = fzy_score_of(match);
+    } else {
+        const Span item = m->items.data[index];
+        r->data = m->buffer.data + item.offset;
+        r->size = item.size;
+        r->score = -INFINITY;
+    }
+
+    r->positions = m->positions.data;
+    r->positions_count = m->positions.count;
+    return 1;
+}
@@ -0,0 +1,80 @@
+#ifndef MENU_H
+#define MENU_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __GNUC__
+#    define MENU_API __attribute__((visibility("default")))
+#else
+#    define MENU_API
+#endif
+
+typedef struct Menu Menu;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    double score;
+
+    // Byte offsets into the line of the characters which matched the query
+    const size_t *positions;
+    size_t positions_count;
+} MenuResult;
+
+MENU_API Menu *menu_new(void);
+MENU_API void  menu_free(Menu *m);
+
+// Match only the fields FIRST to LAST (numbered from 1) of every line, split by DELIMITER. Applies
+// to the items loaded afterwards
+MENU_API void menu_fields(Menu *m, char delimiter, size_t first, size_t last);
+
+// Drop the lines already loaded, keeping only the first occurrence of each. Applies to the items
+// loaded afterwards
+MENU_API void   menu_unique(Menu *m, int unique);
+MENU_API size_t menu_duplicates(const Menu *m);
+
+// Append every non empty line of the stream or buffer as an item. Returns 0 when reading fails, or
+// when the items would not fit in 32 bits, in which case the lines past the last one that does are
+// dropped
+MENU_API int menu_load(Menu *m, FILE *f);
+MENU_API int menu_append(Menu *m, const char *data, size_t size);
+
+// Replace the items with the lines of DATA. Only the lines which were not among the previous items
+// are matched again, and the ones which do not fit in 32 bits are dropped. Returns the number of
+// items whose line was already there
+MENU_API size_t menu_replace(Menu *m, const char *data, size_t size);
+
+// Replace the items with the lines of the stream like menu_replace, reading it straight into the
+// menu. Returns 0 when reading fails, keeping the previous items
+MENU_API int menu_reload(Menu *m, FILE *f);
+
+// The index after the last replace of the item which was at ITEM before it, or SIZE_MAX when its
+// line is gone
+MENU_API size_t menu_moved(const Menu *m, size_t item);
+
+// Write the items to an index at PATH, which menu_open maps in place of the current items without
+// parsing. The index is shared between processes through the page cache, and copied on the first
+// modification
+MENU_API int menu_save(const Menu *m, const char *path);
+MENU_API int menu_open(Menu *m, const char *path);
+
+// Print how every query is matched, picked from the statistics of the items, and what it cost to F.
+// Nothing is printed when F is NULL
+MENU_API void menu_debug(Menu *m, FILE *f);
+
+MENU_API void   menu_query(Menu *m, const char *query, size_t size);
+MENU_API size_t menu_count(const Menu *m);
+MENU_API size_t menu_items(const Menu *m);
+
+// The index in the input of the item ranked at INDEX
+MENU_API size_t menu_item(Menu *m, size_t index);
+
+// The rank of the item at index ITEM in the input, or SIZE_MAX when it does not match the query
+MENU_API size_t menu_rank(const Menu *m, size_t item);
+
+// Fetch the result at INDEX in the ranking of the current query. The positions are valid until the
+// next call into the menu
+MENU_API int menu_result(Menu *m, size_t index, MenuResult *r);
+
+#endif // MENU_H
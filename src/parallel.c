@@ -0,0 +1,48 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+size_t parallel_cpus(void) {
+    static size_t cpus = 0;
+    if (!cpus) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = online > 0 ? online : 1;
+    }
+    return cpus;
+}
+
+size_t parallel_threads(size_t count, size_t min) {
+    size_t threads = count / min;
+    if (threads > parallel_cpus()) {
+        threads = parallel_cpus();
+    }
+
+    if (threads > PARALLEL_MAX) {
+        threads = PARALLEL_MAX;
+    }
+
+    return threads ? threads : 1;
+}
+
+void parallel_run(void *tasks, size_t size, size_t count, void *(*run)(void *)) {
+    char *task = tasks;
+
+    pthread_t threads[PARALLEL_MAX];
+    size_t    started = 1;
+    for (; started < count; started++) {
+        if (pthread_create(&threads[started], NULL, run, task + started * size)) {
+            break;
+        }
+    }
+
+    // Tasks whose thread could not be started run here instead
+    run(task);
+    for (size_t i = started; i < count; i++) {
+        run(task + i * size);
+    }
+
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+#define PARALLEL_MAX 64
+
+size_t parallel_cpus(void);
+
+// The number of threads worth splitting COUNT units of work into, with at least MIN units each
+size_t parallel_threads(size_t count, size_t min);
+
+// Run the function on every task of the array, in threads when there is more than one
+void parallel_run(void *tasks, size_t size, size_t count, void *(*run)(void *));
+
+#endif // PARALLEL_H
@@ -33,9 +33,15 @@ void prompt_end(Prompt *p) {
     p->cursor = p->count;
 }
 
+static bool is_continuation(char ch) {
+    return (ch & 0xC0) == 0x80;
+}
+
 void prompt_prev_char(Prompt *p) {
-    if (p->cursor) {
-        p->cursor--;
+    while (p->cursor) {
+        if (!is_continuation(p->data[--p->cursor])) {
+            break;
+        }
     }
 }
 
@@ -43,10 +49,14 @@ void prompt_next_char(Prompt *p) {
     if (p->cursor < p->count) {
         p->cursor++;
     }
+
+    while (p->cursor < p->count && is_continuation(p->data[p->cursor])) {
+        p->cursor++;
+    }
 }
 
 static bool is_word(char ch) {
-    return isalnum(ch) || ch == '_';
+    return (ch & 0x80) || isalnum(ch) || ch == '_';
 }
 
 void prompt_prev_word(Prompt *p) {
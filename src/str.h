@@ -8,8 +8,16 @@ typedef struct {
     size_t size;
 } Str;
 
+typedef struct {
+    size_t offset;
+    size_t size;
+} Span;
+
 #define str_new(d, s) ((Str){.data = (d), .size = (s)})
 
+#define span_new(o, s) ((Span){.offset = (o), .size = (s)})
+#define span_str(d, s) str_new((d) + (s).offset, (s).size)
+
 Str str_split(Str *str, char ch);
 
 #endif // STR_H
@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "stretch.h"
+
+// Pages are only committed once touched, so the reservations are kept well ahead of the items
+#define STRETCH_MIN ((size_t) 1 << 20)
+
+void *stretch_grow(void *data, size_t size, size_t count, size_t *capacity, size_t *reserved,
+                   size_t needed) {
+    size_t bytes = STRETCH_MIN;
+    while (bytes / size < needed * 2) {
+        bytes *= 2;
+    }
+
+    if (!data || *reserved) {
+        // Moving a reservation remaps its pages rather than copying the items
+        void *map = !data ? mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)
+                          : mremap(data, *reserved, bytes, MREMAP_MAYMOVE);
+        if (map != MAP_FAILED) {
+            *reserved = bytes;
+            *capacity = bytes / size;
+            return map;
+        }
+    }
+
+    size_t grown = *capacity ? *capacity * 2 : 128;
+    while (grown < needed) {
+        grown *= 2;
+    }
+
+    void *heap;
+    if (*reserved) {
+        heap = malloc(grown * size);
+        assert(heap);
+        memcpy(heap, data, count * size);
+        munmap(data, *reserved);
+        *reserved = 0;
+    } else {
+        heap = realloc(data, grown * size);
+        assert(heap);
+    }
+
+    *capacity = grown;
+    return heap;
+}
+
+void stretch_release(void *data, size_t reserved) {
+    if (reserved) {
+        munmap(data, reserved);
+    } else {
+        free(data);
+    }
+}
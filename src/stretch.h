@@ -0,0 +1,47 @@
+#ifndef STRETCH_H
+#define STRETCH_H
+
+#include <string.h>
+
+// Arrays which reserve twice the address space they need and grow within it, so the items streamed
+// into them are never copied. Once the reservation runs out it is extended in place when possible,
+// or its pages are moved elsewhere, so the data may move whenever the array grows and must not be
+// pointed into across appends. They fall back to copying on the heap when no address space is left
+#define Stretch(T)                                                                                 \
+    struct {                                                                                       \
+        T *data;                                                                                   \
+        size_t count;                                                                              \
+        size_t capacity;                                                                           \
+        size_t reserved;                                                                           \
+    }
+
+void *stretch_grow(void *data, size_t size, size_t count, size_t *capacity, size_t *reserved,
+                   size_t needed);
+void  stretch_release(void *data, size_t reserved);
+
+#define stretch_free(l)                                                                            \
+    do {                                                                                           \
+        stretch_release((l)->data, (l)->reserved);                                                 \
+        memset((l), 0, sizeof(*(l)));                                                              \
+    } while (0)
+
+#define stretch_append_many(l, v, c)                                                               \
+    do {                                                                                           \
+        if ((l)->count + (c) > (l)->capacity) {                                                    \
+            (l)->data = stretch_grow((l)->data, sizeof(*(l)->data), (l)->count, &(l)->capacity,    \
+                                     &(l)->reserved, (l)->count + (c));                            \
+        }                                                                                          \
+                                                                                                   \
+        if ((v) != NULL) {                                                                         \
+            memcpy((l)->data + (l)->count, (v), (c) * sizeof(*(l)->data));                         \
+            (l)->count += (c);                                                                     \
+        }                                                                                          \
+    } while (0)
+
+#define stretch_append(l, v)                                                                       \
+    do {                                                                                           \
+        stretch_append_many((l), NULL, 1);                                                         \
+        (l)->data[(l)->count++] = (v);                                                             \
+    } while (0)
+
+#endif // STRETCH_H
@@ -0,0 +1,235 @@
+#ifdef __SSE2__
+#    include <emmintrin.h>
+#endif
+
+#include "utf8.h"
+
+#define in(c, a, b) ((a) <= (c) && (c) <= (b))
+
+size_t utf8_decode(Str str, size_t at, uint32_t *rune) {
+    const unsigned char *s = (const unsigned char *) str.data + at;
+    const size_t size = str.size - at;
+
+    if (s[0] < 0x80) {
+        *rune = s[0];
+        return 1;
+    }
+
+    size_t length = 0;
+    uint32_t min = 0;
+    if (in(s[0], 0xC2, 0xDF)) {
+        length = 2;
+        min = 0x80;
+        *rune = s[0] & 0x1F;
+    } else if (in(s[0], 0xE0, 0xEF)) {
+        length = 3;
+        min = 0x800;
+        *rune = s[0] & 0x0F;
+    } else if (in(s[0], 0xF0, 0xF4)) {
+        length = 4;
+        min = 0x10000;
+        *rune = s[0] & 0x07;
+    }
+
+    if (!length || length > size) {
+        *rune = UTF8_INVALID;
+        return 1;
+    }
+
+    for (size_t i = 1; i < length; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            *rune = UTF8_INVALID;
+            return 1;
+        }
+        *rune = (*rune << 6) | (s[i] & 0x3F);
+    }
+
+    if (*rune < min || *rune > 0x10FFFF || in(*rune, 0xD800, 0xDFFF)) {
+        *rune = UTF8_INVALID;
+        return 1;
+    }
+
+    return length;
+}
+
+size_t utf8_encode(uint32_t rune, char *out) {
+    if (rune < 0x80) {
+        out[0] = rune;
+        return 1;
+    }
+
+    if (rune < 0x800) {
+        out[0] = 0xC0 | (rune >> 6);
+        out[1] = 0x80 | (rune & 0x3F);
+        return 2;
+    }
+
+    if (rune < 0x10000) {
+        out[0] = 0xE0 | (rune >> 12);
+        out[1] = 0x80 | ((rune >> 6) & 0x3F);
+        out[2] = 0x80 | (rune & 0x3F);
+        return 3;
+    }
+
+    out[0] = 0xF0 | (rune >> 18);
+    out[1] = 0x80 | ((rune >> 12) & 0x3F);
+    out[2] = 0x80 | ((rune >> 6) & 0x3F);
+    out[3] = 0x80 | (rune & 0x3F);
+    return 4;
+}
+
+uint32_t utf8_fold(uint32_t c) {
+    if (c < 0x80) {
+        return in(c, 'A', 'Z') ? c + 32 : c;
+    }
+
+    // Latin
+    if (in(c, 0xC0, 0xDE) && c != 0xD7) {
+        return c + 32;
+    }
+
+    if (c == 0xB5) {
+        return 0x3BC;
+    }
+
+    if (in(c, 0x100, 0x12F) || in(c, 0x132, 0x137) || in(c, 0x14A, 0x177)) {
+        return c | 1;
+    }
+
+    if (in(c, 0x139, 0x148) || in(c, 0x179, 0x17E)) {
+        return c + (c & 1);
+    }
+
+    if (c == 0x178) {
+        return 0xFF;
+    }
+
+    if (c == 0x17F) {
+        return 's';
+    }
+
+    if (in(c, 0x1E00, 0x1E95) || in(c, 0x1EA0, 0x1EFF)) {
+        return c | 1;
+    }
+
+    if (c == 0x1E9E) {
+        return 0xDF;
+    }
+
+    // Greek
+    if (in(c, 0x391, 0x3A1) || in(c, 0x3A3, 0x3AB)) {
+        return c + 32;
+    }
+
+    if (c == 0x386) {
+        return 0x3AC;
+    }
+
+    if (in(c, 0x388, 0x38A)) {
+        return c + 37;
+    }
+
+    if (c == 0x38C) {
+        return 0x3CC;
+    }
+
+    if (in(c, 0x38E, 0x38F)) {
+        return c + 63;
+    }
+
+    if (c == 0x3C2) {
+        return 0x3C3;
+    }
+
+    if (in(c, 0x3D8, 0x3EF)) {
+        return c | 1;
+    }
+
+    // Cyrillic
+    if (in(c, 0x400, 0x40F)) {
+        return c + 80;
+    }
+
+    if (in(c, 0x410, 0x42F)) {
+        return c + 32;
+    }
+
+    if (in(c, 0x460, 0x481) || in(c, 0x48A, 0x4BF) || in(c, 0x4D0, 0x52F)) {
+        return c | 1;
+    }
+
+    if (c == 0x4C0) {
+        return 0x4CF;
+    }
+
+    if (in(c, 0x4C1, 0x4CE)) {
+        return c + (c & 1);
+    }
+
+    // Armenian and Georgian
+    if (in(c, 0x531, 0x556)) {
+        return c + 48;
+    }
+
+    if (in(c, 0x10A0, 0x10C5)) {
+        return c + 0x1C60;
+    }
+
+    // Symbols
+    switch (c) {
+    case 0x2126:
+        return 0x3C9;
+
+    case 0x212A:
+        return 'k';
+
+    case 0x212B:
+        return 0xE5;
+    }
+
+    if (in(c, 0x2160, 0x216F)) {
+        return c + 16;
+    }
+
+    if (in(c, 0x24B6, 0x24CF)) {
+        return c + 26;
+    }
+
+    // Glagolitic, Fullwidth and Deseret
+    if (in(c, 0x2C00, 0x2C2F)) {
+        return c + 48;
+    }
+
+    if (in(c, 0xFF21, 0xFF3A)) {
+        return c + 32;
+    }
+
+    if (in(c, 0x10400, 0x10427)) {
+        return c + 40;
+    }
+
+    return c;
+}
+
+int utf8_ascii(Str str) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i bits = _mm_setzero_si128();
+    for (; i + 16 <= str.size; i += 16) {
+        bits = _mm_or_si128(bits, _mm_loadu_si128((const __m128i *) (str.data + i)));
+    }
+
+    if (_mm_movemask_epi8(bits)) {
+        return 0;
+    }
+#endif
+
+    for (; i < str.size; i++) {
+        if (str.data[i] & 0x80) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
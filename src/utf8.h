@@ -0,0 +1,19 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdint.h>
+
+#include "str.h"
+
+#define UTF8_INVALID 0xFFFD
+
+// Decode the codepoint at AT, returning its length in bytes. Invalid bytes decode one at a time
+size_t utf8_decode(Str str, size_t at, uint32_t *rune);
+size_t utf8_encode(uint32_t rune, char *out);
+
+// Simple case folding of the common scripts
+uint32_t utf8_fold(uint32_t rune);
+
+int utf8_ascii(Str str);
+
+#endif // UTF8_H